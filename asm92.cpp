@@ -52,10 +52,10 @@
                 
                 Thus, 'BR FC' will branch to an address equal to PC - 4
         * If the outgoing carry out signal from the PSW is not fed directly into the 
-            carry in (Cin) of the ALU, then modify the "ALU_CARRY_ADJUST" preprocessor
-            macro below to 1 (instead of 2) and recompile this assembler. This ensures
-            that the offset for a back branch (branching to a label before the 
-            current instruction) is computed correctly.
+            carry in (Cin) of the ALU, then select a target profile with a carry adjust
+            of 1 (instead of 2), see Target Profiles below. This ensures that the offset
+            for a back branch (branching to a label before the current instruction) is
+            computed correctly.
 
     Assembler Directives:
      - Specified by '@' followed by directive name
@@ -63,10 +63,124 @@
         - 'base_addr' - sets the base address for program in memory, modfying all addresses in
             program accordingly. Default is 0x00.
             Usage: @base_addr=1F        // sets base address to 0x1F
+        - 'org' - continues the program at the given address, starting a new region of memory.
+            Only populated bytes are written in the 'regions' output format (see -f).
+            Usage: @org=F0              // following code is placed from 0xF0
+        - 'var' - declares a named variable whose address is assigned by the assembler. Must be
+            declared before use. Reference as '$name' (direct address) or 'name' (address as
+            an immediate). Variables never live at the same time may share a byte, and the
+            program, stack region and I/O registers are never assigned.
+            Usage: @var=sum             // declares variable 'sum'
+                   MOV $sum, 12         // (sum) = 0x12
+        - 'macro' / 'endm' - defines a reusable instruction sequence with optional parameters.
+            In the body '\param' is replaced by an argument and '\@' by a number unique to the
+            expansion (for local labels). Macros may invoke other macros (max depth 16).
+            Usage: @macro BRV tmp, lbl     // branch to lbl if V flag set
+                       mov \tmp, $C8
+                       and \tmp, 4
+                       cmp \tmp, 4
+                       brz \lbl
+                   @endm
+                   BRV $51, exit
+        - 'include' - inserts another code file (path relative to the including file). Each file
+            is included at most once per program, and is only read once when assembling a batch.
+            Usage: @include "lib/flags.asm"
+        - 'byte' / 'fill' / 'data' / 'incbin' - place data (eg. lookup tables) at the current address.
+            Usage: @byte 01, 2F, aLabel     // listed bytes, hex or label address
+                   @fill 10, FF             // 0x10 bytes of 0xFF
+                   @data 00112233 44556677  // hex digit pairs, whitespace ignored
+                   @incbin "table.bin"      // contents of binary file
+        - 'if' / 'else' / 'endif' - assemble lines only if a constant expression is non-zero
+            (see Conditional Assembly). Names are defined on the command line with -D.
+            Usage: @if DEBUG && base_addr < 80     // ./asm -D DEBUG code.asm
+                       mov $C0, $50
+                   @endif
+        - 'window' / 'overlay' / 'endoverlay' - code that does not fit in memory is split into
+            overlays, which share the overlay window and are swapped in by the bank-switch
+            device. Calls into an overlay load it through a generated thunk.
+            Usage: @window=80              // overlays are placed from 0x80
+                   @overlay print          // following code is overlay 'print' ...
+                   @endoverlay             // ... up to here
+
+    Disassembly:
+     - './asm --disasm FILE.b' decodes a binary file back into code (FILE.asm) that assembles
+        to identical bytes, using the reverse of the instruction mapping. Jump/branch targets
+        are labelled, undoing the relative branch math. See help text for options.
+
+    16-bit Address Mode:
+     - Patterns in mapping.conf may declare 2 byte operands by doubling the letter: 'XX' for
+        an immediate, 'AA'/'BB' for a direct address (eg. "MOV AA, X : C0"). 2 byte operands
+        are stored low byte first.
+     - A numeric operand above FF is 2 bytes ('$0456', '1234'). Written with 3 or 4 digits
+        below that ('$0050'), it is 2 bytes only if the profile has more than 256 bytes of
+        memory and a wide form is mapped, otherwise 1 byte.
+     - If the target profile has more than 256 bytes of memory, labels, variables and JMP/JSR
+        targets are 2 bytes, and base_addr/org take addresses up to FFFF. Relative branch
+        offsets stay 1 byte (-80 to 7F), anything further away must use JMP.
+
+    Target Profiles:
+     - Hardware variants are described in 'targets.conf' (same directory as mapping.conf):
+            NAME : CARRY IO_FIRST IO_LAST MEM_SIZE FETCH OPERAND     (all hex)
+        ie. the back branch carry adjust, the memory mapped I/O registers, the size of memory
+        and the cost model (cycles to fetch an opcode, and each operand byte).
+        The built-in 'default' profile is: 2 C0 CB 100 3 1
+     - '-t NAME1,NAME2,...' selects the profiles to assemble for. With more than one, the program
+        is assembled once and only the relative branches are re-encoded for each profile, writing
+        one out file per profile (eg. ram.nocin.b). Variables are placed clear of the I/O
+        registers and within the memory of every selected profile, so all images share one layout.
+
+    Overlays / Emulation:
+     - Each overlay is written to its own image (eg. ram.print.b). The swaps along each call
+        path are reported after assembly (a call swaps if its overlay is not loaded).
+     - './asm --run FILE.asm [IN ...]' assembles and runs the program on the ISA emulator
+        (emu92.h) with the given input bytes, reporting the output bytes, instructions,
+        cycles (from the target profile's cost model) and overlay swaps
+     - '-c' counts cycles as the microcoded hardware takes them: the fetch plus the length of
+        each instruction's microroutine, from 'cycles.conf' (lines of MPC : CYCLES [TAKEN]),
+        or up to the next MPC address in mapping.conf where it has no entry
+     - './asm --fuzz FILE.asm [SECONDS]' mutates the program's input bytes, guided by the
+        coverage of its jumps and branches, looking for inputs that fault, hang or take the
+        most cycles. Inputs found are kept in FILE.fuzz/.
+
+    Language Server:
+     - './asm --lsp' serves editors over the Language Server Protocol (stdio): diagnostics as
+        you type, go-to-definition and find-references for labels and variables, and the
+        address, bytes and cycles of each line as inlay hints and on hover
+
+    Line Scanner:
+     - Code is split into lines, and each line's comment, label and mnemonic found, from
+        character class masks built 16/32 bytes at a time with SIMD (see scan.h)
+     - './asm --scanbench [MB]' reports the throughput of the scanner, lexer and assembler
+        on MB megabytes of generated source
+     - './asm --perffuzz [SECONDS]' mutates code looking for inputs that take the assembler
+        more than a linear budget of time or allocations per byte (perf_fail_N.asm)
+
+    Batch Mode:
+     - './asm --batch' reads code files and writes images with many files in flight while
+        assembling, through io_uring on Linux or a thread pool elsewhere (see batchio.h)
+     - '-i uring|threads|sync' selects the file I/O, and './asm --iobench [N]' compares them
+        in files per second on N generated code files
+
+    Compile-Time Assembly:
+     - casm92.h assembles programs embedded in C++20 code while compiling, to std::array
+        images, using the same instruction codes (icodeof) and mapping.conf format as asm92
+
+    Microcode Linking:
+     - './asm --microlink ROUTINES.mc' packs microroutine sources into the microstore, sharing
+        routines that are the tail of another, and regenerates mapping.conf (see micro.h)
+     - '-m FIELDS' compacts the routines first, merging microoperations of the control word
+        fields defined in FIELDS that do not conflict into fewer words (shorter instructions)
+     - './asm --microprof FILE.asm ...' runs a corpus of programs (and the inputs in their fuzz
+        corpora) in timing mode, and reports the runs and cycles of each microroutine and the
+        most executed microaddresses
+
+    Stack Analysis:
+     - After assembly the max stack depth is computed for the program entry point and for
+        every subroutine (JSR target). PSH/JSR push 1 byte, POP/RTS pop 1 byte.
+     - Recursion (unbounded depth) and unbalanced PSH/POP paths are reported as warnings
+     - If the stack pointer is loaded with an immediate (LSP X) the minimal stack region
+        below X is reported, and checked for overlap with the program and I/O registers
 
-    TODO : Fix label bug - labels must contain at least 1 valid hex character otherwise program will
-            error. (ie. 'loop1' vs 'loop') - any label should be valid. Perhaps during label parsing
-            (1st pass) only validate mnemonics before skipping to next line.
     TODO : convert to one pass compiler - write undefined labels to cache and write temp value to
             file. Once a label is found iterate through undefined label and check for matches, 
             reseeking to temp value in file and overwriting with appropriate label address. 
@@ -74,18 +188,79 @@
 */
 
 #include "strim.h"          // http://www.martinbroadhurst.com/how-to-trim-a-stdstring.html
+#include "hex.h"
+#include "micro.h"
+#include "emu92.h"
+#include "json.h"
+#include "scan.h"
+#include "casm92.h"
+#include "batchio.h"
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <filesystem>
 #include <unordered_map>    
 #include <set>
-#include <regex>
+#include <map>
+#include <algorithm>
+#include <vector>
+#include <sstream>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <array>
 
-#define ALU_CARRY_ADJUST 2
+#define ALU_CARRY_ADJUST 2      // defaults of the built-in target profile
+#define IO_FIRST 0xC0           // first memory mapped I/O register (output buffer)
+#define IO_LAST 0xCB            // last byte of memory mapped I/O registers (PSW at 0xC8)
 
 // function prototypes
 void load(std::ifstream& conf);           // loads instruction mapping from 'mapping.conf' file in same directory
-void parse(std::ifstream& in, std::ofstream& out, std::string& infilename, std::string& outfilename, bool write);
+void loadprofiles(std::ifstream& conf);   // loads target profiles from 'targets.conf' file in same directory
+void loadcycles(std::ifstream& conf);     // loads microroutine cycles from 'cycles.conf' file in same directory
+struct Line;
+struct Instr;
+struct Unit;
+struct Region;
+bool assemble(std::string& infilename, std::string& outfilename, const std::string* text = nullptr);   // assembles code file (or its text, if read already) to out file
+void buildrmap();                         // builds reverse instruction map from imap
+int hexbyte(const std::string& str);      // value of 1 or 2 digit hex string
+int hexword(const std::string& str);      // value of 1 to 4 digit hex string
+bool disassemble(std::string& infilename, std::string& outfilename);    // disassembles binary file to code file
+void disasm(const std::vector<unsigned char>& mem, int dbase, std::string& buf);   // disassembles bytes to code
+int verify(const std::vector<std::string>& files);         // round trip verification of corpus
+int emulate(const std::string& file, const std::vector<std::string>& input);    // assembles and runs code file
+int fuzz(const std::string& file, int seconds);             // searches for inputs that fault, hang or take most cycles
+int microprofile(const std::vector<std::string>& files);    // counts microstore executions over a corpus of programs
+int lspserve();                                             // language server on stdin/stdout
+int scanbench(int mb);                                      // benchmarks line scanner, lexer and assembler
+int perffuzz(int seconds);                                  // searches for code that assembles in more than linear time
+int batch(const std::vector<std::string>& files);           // assembles each code file to an out file of the same name
+int iobench(int count);                                     // benchmarks batch mode file I/O
+std::shared_ptr<const Unit> lex(const std::string& path);   // reads code file, cached while it is unchanged
+void lexstream(std::istream& in, Unit& unit);               // reads code into unit
+void lexbuffer(const std::string& buf, Unit& unit);         // tokenizes code held in memory into unit
+bool build(const Unit& unit, std::vector<Region>& image);   // assembles unit into memory image
+void splice(const Unit& unit, std::vector<Line>& src, int depth);  // appends unit to source, expanding macros and includes
+void overlay(std::vector<Line>& src);    // numbers overlays and generates thunks for calls into them
+void parse(std::vector<Line>& src, bool write);
+int target(const Instr& ins);             // absolute target of jump/branch
+int target(int addr, const std::string& mnemonic, int op);  // absolute target of jump/branch at addr with operand op
+void stackcheck();                        // computes max stack depth of assembled program
+void allocvars();                         // assigns addresses to @var variables
+void listing();                           // writes assembled program to console
+std::vector<Region> layout(int sec = 0);  // collects assembled program (or an overlay) into memory regions
+void swapreport();                        // reports overlay swaps of each call path
+int encodetarget(const std::string& mnemonic, int addr, int to);     // encodes jump/branch operand
+struct Profile;
+std::vector<Region> retarget(const Profile& p);  // re-encodes relative branches for another target profile
+int cost();                               // straight-line cycle cost of assembled program
+int writeimage(const std::string& name, const std::vector<Region>& image);    // writes regions to out file in output format
 
 /*
     Instruction Map
@@ -153,14 +328,275 @@ std::unordered_map<uint32_t, unsigned char> imap ({
                         {0x4A4D5010, 0x50},         // JMP X [test mapping]
                         {0x42520010, 0x80}          // BR X [test mapping]
 });
-std::unordered_map<std::string, unsigned char> directives ({
+thread_local std::unordered_map<std::string, int> directives ({
     {"base_addr", 0x00}                             // base address of program in memory
 });
-bool adjustBase = false;
+thread_local std::unordered_map<std::string,int> lblmap;       // maps labels to addresses
+thread_local bool adjustBase = false;
+
+/*
+    Reverse Instruction Map
+    - Maps each MPC address (opcode byte) back to the mnemonic and operand types of the
+        instruction it begins, for disassembly. Built from imap once mapping.conf is loaded.
+*/
+struct Opcode {
+    std::string mnemonic;       // empty if no instruction begins at this MPC address
+    int numops;
+    unsigned char optype[2];
+    int size;                   // bytes occupied by instruction
+};
+Opcode rmap[256];
+int dbase = 0;                  // address of first byte of disassembled binary file
+bool recursive = false;         // disassemble by traversing control flow from first byte (otherwise linearly)
+int jobs = 0;                   // threads used for round trip verification (0 = one per core)
+int gencount = 0;               // number of generated programs added to round trip corpus
+
+/*
+    Target Profiles
+    - Each hardware variant differs only in the values below, so a program assembled for one
+        profile is converted to another by re-encoding its relative branches (retarget())
+*/
+struct Profile {
+    std::string name;
+    int carry;                  // back branch adjustment for ALU carry (see ALU_CARRY_ADJUST)
+    int iofirst, iolast;        // memory mapped I/O registers
+    int memsize;                // bytes of memory
+    int fetch, operand;         // cost model - cycles to fetch an opcode, and each operand byte
+};
+std::map<std::string,Profile> profiles ({
+    {"default", {"default", ALU_CARRY_ADJUST, IO_FIRST, IO_LAST, 256, 3, 1}}
+});
+std::vector<const Profile*> targets;                // profiles selected with -t (first is used for analyses)
+thread_local const Profile* profile = nullptr;      // profile relative branches are currently encoded for
+std::map<int,std::array<int,2>> mcycles;            // cycles of the microroutine at each MPC, and when its branch is taken (cycles.conf)
+bool timing = false;                                // emulator charges microroutine cycles instead of the cost model (-c)
+
+/*
+    Operand Types
+    - 1 immediate, 2 direct address, each 1 byte ('X', 'A'/'B' in mapping.conf)
+    - 3 wide immediate, 4 wide direct address, each 2 bytes low byte first ('XX', 'AA'/'BB')
+    - A numeric operand written with more than 2 digits is wide if its value is above $FF, or
+        if the target profile has more than 256 bytes of memory and a wide form is mapped.
+        Labels, variables and JMP/JSR targets are wide if the profile has more than 256 bytes.
+*/
+int width(unsigned char optype) { return optype > 2 ? 2 : optype ? 1 : 0; }
+bool immediate(unsigned char optype) { return optype == 1 || optype == 3; }
+bool direct(unsigned char optype) { return optype == 2 || optype == 4; }
+bool widemode() { return profile->memsize > 256; }
+int addrmask() { return widemode() ? 0xFFFF : 0xFF; }
 const std::set<std::string> jmpcodes ({     // valid jump/branch mnemonics
     {"JMP", "JSR", "BR", "BRZ", "BRN"}
 });
 
+/*
+    Assembled Program
+    - Every instruction written during the second pass is also recorded here in
+        address order, so that analyses needing the control flow of the program
+        (rather than the raw byte stream) can be run once assembly is complete
+    - ops[] hold the final encoded operand values (ie. relative branch offsets are
+        already computed), 1 or 2 bytes wide according to optype[]
+*/
+struct Instr {
+    int addr;                   // address of opcode
+    std::string mnemonic;
+    int numops;
+    int ops[2];
+    unsigned char optype[2];
+    int var[2];                 // index of variable referenced by each operand (-1 if none)
+    int dest;                   // label address of relative branch (-1 if none), re-encoded per profile
+    int sec;                    // section holding instruction (0 resident, n overlay n-1)
+    int tsec;                   // section holding jump/branch target
+    unsigned char mpc;
+    int linenum;
+    const std::string* file;    // code file of source line (nullptr if generated)
+    std::string text;           // source line
+    std::vector<unsigned char> data;            // bytes placed by a data directive (not an instruction if non-empty)
+};
+thread_local std::vector<Instr> prog;
+
+// number of bytes occupied by instruction or data
+int length(const Instr& ins) {
+    return ins.data.empty() ? 1 + width(ins.optype[0]) + width(ins.optype[1]) : ins.data.size();
+}
+
+// line of code file, after macro expansion
+struct Line {
+    std::string text;
+    int linenum;                // line number in code file
+    const std::string* file;    // code file the line was read from
+};
+
+// thrown on any error in a code file, after the error has been written to errout
+struct AsmError {};
+
+// assembler messages (listing, analyses) and errors - redirected per thread when assembling in memory
+thread_local std::ostream* msgout = &std::cout;
+thread_local std::ostream* errout = &std::cerr;
+
+/*
+    Macros
+    - Defined between '@macro NAME [param, ...]' and '@endm', invoked by name in place of
+        an instruction: 'NAME arg, ...'
+    - Within the body '\param' is replaced by the corresponding argument and '\@' by a
+        number unique to each expansion, for local labels (eg. 'skip\@:')
+    - Each body line is split into literal text and substitution tokens once, when the
+        macro is defined. An expansion only concatenates the cached tokens.
+*/
+struct Token {
+    int param;                  // index of substituted parameter, -1 for literal text, -2 for '\@'
+    std::string text;
+};
+struct Macro {
+    std::vector<std::string> params;
+    std::vector<std::vector<Token>> body;       // tokenized body lines
+    int linenum;                // line of definition
+};
+thread_local std::unordered_map<std::string,const Macro*> macros;       // macros defined in current program
+thread_local int expansions = 0;             // number of expansions so far, substituted for '\@'
+#define MACRO_DEPTH 16          // max depth of nested macro expansion
+
+/*
+    Parsed Units
+    - Every code file (assembled or included) is read and split into lines once, with its
+        macro definitions tokenized, and cached by path. A file included by many programs in
+        a batch is only re-read if its modification time changes.
+    - Cached units are shared and never modified: a changed file replaces its entry with a
+        new unit, and the least recently used entries are dropped beyond UNIT_CACHE units.
+        The program being assembled holds the units it was spliced from, as its lines point
+        to their paths and its macros into their definitions.
+    - Macro definitions are replaced in the cached lines by a single '@macro NAME' line,
+        which defines the macro when the unit is spliced into a program
+    - Labels are not cached since their addresses depend on the including program
+    - A file is included at most once per program (implicit include guard)
+*/
+struct Unit {
+    std::string path;                                       // canonical path
+    std::filesystem::file_time_type mtime;                  // modification time when read
+    std::vector<Line> lines;
+    std::unordered_map<std::string,Macro> macros;           // macros defined in file
+    std::unordered_map<int,int> branches;                   // maps index of each @if/@else line to its @else/@endif
+};
+#define UNIT_CACHE 64           // parsed units kept
+struct CachedUnit {
+    std::shared_ptr<const Unit> unit;
+    long used;                                              // lookup count when last used
+};
+std::unordered_map<std::string,CachedUnit> units;           // maps canonical path to parsed unit
+long unitlookups = 0;
+std::mutex unitlock;                                        // guards units when assembling in parallel
+thread_local std::vector<std::shared_ptr<const Unit>> held;              // units included in current program
+thread_local std::set<std::string> included;                             // files included in current program
+#define INCLUDE_DEPTH 16        // max depth of nested includes
+
+/*
+    Conditional Assembly
+    - '@if EXPR' / '@else' / '@endif' select lines when the program is spliced together, so
+        inactive lines are never included, expanded or parsed
+    - The lexer matches every @if and @else to its terminator once per file (cached with the
+        unit), so an inactive region is skipped in one step rather than scanned line by line
+    - EXPR is a constant expression of hex numbers, names defined on the command line (-D)
+        and directives assigned earlier in the program (eg. base_addr), with operators
+        ( ) ! - + & | == != < <= > >= && || and defined(NAME). A name that is not defined
+        is 0 (a word that is not defined but is valid hex is a number).
+    - Conditionals may not appear inside macro bodies, and must be balanced within a file
+*/
+std::unordered_map<std::string,int> defines;                             // names defined on the command line (-D)
+thread_local std::unordered_map<std::string,int> symbols;                // defines and directives assigned so far, for @if
+#define COND_DEPTH 64           // max nesting of conditionals
+
+/*
+    Variables
+    - Declared with the 'var' directive and referenced by name in place of an address
+        ('$name' for the variable, 'name' for its address as an immediate)
+    - Addresses are assigned after assembly by allocvars(). Variables whose lifetimes
+        do not overlap share a byte.
+*/
+struct Var {
+    std::string name;
+    int addr;                   // assigned address (-1 until allocated)
+    int linenum;                // line of declaration
+};
+thread_local std::vector<Var> vars;
+thread_local std::unordered_map<std::string,int> varmap;                 // maps variable names to index in vars
+thread_local int stacklo = -1, stackhi = -1;                             // stack region found by stackcheck()
+
+/*
+    Overlays
+    - Code between '@overlay NAME' and '@endoverlay' is assembled at the overlay window
+        ('@window=XX'), all overlays sharing the same addresses. Each overlay is written to
+        its own image and loaded into the window by the bank-switch device (see emu92.h).
+    - A JSR into an overlay from outside it is redirected to a resident thunk, generated
+        after the program, that loads the overlay, calls the subroutine and restores the
+        caller's overlay on return:
+            __ovl_SUB:  PSH $CC / MOV $CC, N / JSR SUB / POP $CC / RTS
+    - Jumps and branches into an overlay from outside it are errors
+    - Analyses identify code by section and address (site()), since overlays share addresses
+*/
+thread_local std::vector<std::string> overlays;                         // overlay names, numbered in order of appearance
+thread_local int window = -1;                                           // overlay window address (-1 if not set)
+thread_local std::unordered_map<std::string,int> lblsec;                // maps labels to section (0 resident, n overlay n-1)
+
+// key identifying an address within a section
+int site(int sec, int addr) { return sec << 16 | addr; }
+
+/*
+    Memory Image
+    - The assembled program as a sparse list of contiguous populated regions, sorted by
+        address. '@org' starts a new region anywhere in memory.
+    - Written to the out file in one of the following formats:
+        dense       raw bytes from the lowest to highest populated address, with gaps
+                    padded with 0x00 (default)
+        regions     only populated bytes, as a sequence of records:
+                    [start address] [length (0x00 = 256)] [bytes ...]
+                    (start address is 2 bytes, low first, in 16-bit address mode)
+        logisim     Logisim "v2.0 raw" memory image from address 0x00, with runs of
+                    repeated bytes compressed as "count*value"
+        ihex        Intel HEX records for populated bytes
+    - Each format is a writer that formats the whole image into a buffer, which is then
+        written to the out file in a single call
+*/
+struct Region {
+    int start;
+    std::vector<unsigned char> bytes;
+};
+void writedense(const std::vector<Region>& image, std::string& buf);
+void writeregions(const std::vector<Region>& image, std::string& buf);
+void writelogisim(const std::vector<Region>& image, std::string& buf);
+void writeihex(const std::vector<Region>& image, std::string& buf);
+struct Format {
+    void (*write)(const std::vector<Region>& image, std::string& buf);
+    std::string ext;            // extension of out files in batch mode
+};
+const std::map<std::string,Format> formats ({
+    {"dense",   {writedense, ".b"}},
+    {"regions", {writeregions, ".b"}},
+    {"logisim", {writelogisim, ".img"}},
+    {"ihex",    {writeihex, ".hex"}}
+});
+std::string format = "dense";                               // output format
+IoMode iomode = IO_URING;                                   // file I/O of batch mode (-i)
+BatchIO* batchio = nullptr;                                 // reads and writes files of the batch being assembled
+
+// reset state of previously assembled program
+void reset() {
+    for (auto& d : directives) d.second = 0;
+    adjustBase = false;
+    lblmap.clear();
+    prog.clear();
+    macros.clear();
+    held.clear();
+    expansions = 0;
+    included.clear();
+    vars.clear();
+    varmap.clear();
+    stacklo = -1;
+    stackhi = -1;
+    overlays.clear();
+    window = -1;
+    lblsec.clear();
+    symbols = defines;
+}
+
 
 int main(int argc, char* argv[]) {
 
@@ -168,9 +604,12 @@ int main(int argc, char* argv[]) {
     std::string infilename;                                 // assembly instruction text file
     std::string outfilename = "ram.b";                      // assembled binary file. default = out.b
     const std::string confFilename = "mapping.conf";
+    const std::string targetsFilename = "targets.conf";
+    const std::string cyclesFilename = "cycles.conf";
     
-    // print header
-    std::cout << "\n\
+    // print header (stdout carries the protocol in language server mode)
+    bool lsp = std::find(argv + 1, argv + argc, std::string("--lsp")) != argv + argc;
+    if (!lsp) std::cout << "\n\
     \t      3P92 Assembler\n\
     ===================================\n\
     \tWritten By Tennyson Demchuk\n\
@@ -178,22 +617,213 @@ int main(int argc, char* argv[]) {
     ===================================\n\
     \n";
 
+    // separate options from args
+    std::vector<std::string> args;
+    std::vector<std::string> tnames;                        // target profiles selected with -t
+    std::string fieldsname;                                 // control word fields to compact microroutines with (-m)
+    for (int i=1; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "-b" && i+1 < argc) {
+            if ((dbase = hexword(argv[++i])) < 0) {
+                std::cerr << "Invalid Input. Base address must be a hex value of up to 4 digits: \"" << argv[i] << "\"\n";
+                return -1;
+            }
+        }
+        else if (arg == "-r") recursive = true;
+        else if (arg == "-c") timing = true;
+        else if (arg == "-m" && i+1 < argc) fieldsname = argv[++i];
+        else if ((arg == "-j" || arg == "-g") && i+1 < argc) {
+            int n = atoi(argv[++i]);
+            if (n < 0) n = 0;
+            if (arg == "-j") jobs = n;
+            else gencount = n;
+        }
+        else if (arg.compare(0, 2, "-D") == 0 && (arg.length() > 2 || i+1 < argc)) {
+            std::string def = arg.length() > 2 ? arg.substr(2) : argv[++i];
+            size_t eq = def.find('=');
+            int val = eq == std::string::npos ? 1 : hexword(def.substr(eq + 1));
+            if (val < 0 || def.substr(0, eq) == "") {
+                std::cerr << "Invalid Input. Define must be NAME or NAME=VALUE with a hex value of up to 4 digits: \"" << def << "\"\n";
+                return -1;
+            }
+            defines[def.substr(0, eq)] = val;
+        }
+        else if (arg == "-t" && i+1 < argc) {
+            std::stringstream names(argv[++i]);
+            std::string name;
+            while (getline(names, name, ',')) tnames.push_back(name);
+        }
+        else if (arg == "-i" && i+1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "uring") iomode = IO_URING;
+            else if (mode == "threads") iomode = IO_THREADS_POOL;
+            else if (mode == "sync") iomode = IO_SYNC;
+            else {
+                std::cerr << "Invalid Input. File I/O must be uring, threads or sync: \"" << mode << "\"\n";
+                return -1;
+            }
+        }
+        else if (arg == "-f" && i+1 < argc) {
+            format = argv[++i];
+            if (formats.find(format) == formats.end()) {
+                std::cerr << "Invalid Input. Unknown output format: \"" << format << "\"\n";
+                return -1;
+            }
+        }
+        else args.push_back(arg);
+    }
+
     // validate input
-    if (argc < 2) {
+    if (args.size() < 1) {
         std::cerr << "Invalid Input. Assembly File Required:\n\
         Program Usage: ./asm code.txt [out.b]\n";
         return -1;
     }
 
+    // link microroutines - run before loading the mapping, since it regenerates it
+    if (args[0] == "--microlink") {
+        if (args.size() < 2 || args.size() > 4) {
+            std::cerr << "Invalid Input. Usage: ./asm [-m FIELDS] --microlink ROUTINES.mc [ROM.img] [MAPPING.conf]\n";
+            return -1;
+        }
+        return microlink(args[1], args.size() > 2 ? args[2] : "microstore.img", args.size() > 3 ? args[3] : confFilename, fieldsname);
+    }
+
+    // load mapping config if file present
+    std::ifstream conf(confFilename);
+    if (conf.is_open()) {
+        load(conf);
+        conf.close();
+    }
+    buildrmap();
+
+    // load target profiles if file present, and select targets
+    std::ifstream tconf(targetsFilename);
+    if (tconf.is_open()) {
+        loadprofiles(tconf);
+        tconf.close();
+    }
+    if (tnames.empty()) tnames.push_back("default");
+    for (auto& name : tnames) {
+        if (profiles.find(name) == profiles.end()) {
+            std::cerr << "Invalid Input. Unknown target profile: \"" << name << "\"\n";
+            return -1;
+        }
+        targets.push_back(&profiles.at(name));
+        if ((targets.back()->memsize > 256) != (targets.front()->memsize > 256)) {
+            std::cerr << "Invalid Input. Target profiles " << targets.front()->name << " and " << name << " differ in address width\n";
+            return -1;
+        }
+    }
+    profile = targets.front();
+
+    // load microroutine cycles if file present
+    std::ifstream cconf(cyclesFilename);
+    if (cconf.is_open()) {
+        loadcycles(cconf);
+        cconf.close();
+    }
+
+    // check code files and generated programs survive assembly -> disassembly -> assembly
+    if (args[0] == "--roundtrip")
+        return verify(std::vector<std::string>(args.begin() + 1, args.end()));
+
+    // search for code the assembler is slow on
+    if (args[0] == "--perffuzz") return perffuzz(args.size() > 1 ? std::max(1, atoi(args[1].c_str())) : 10);
+
+    // benchmark line scanner on generated source
+    if (args[0] == "--scanbench") return scanbench(args.size() > 1 ? std::max(1, atoi(args[1].c_str())) : 8);
+
+    // serve editors over the language server protocol
+    if (args[0] == "--lsp") return lspserve();
+
+    // assemble and run program on the emulator
+    if (args[0] == "--run") {
+        if (args.size() < 2) {
+            std::cerr << "Invalid Input. Usage: ./asm --run CODEFILE.asm [INPUT ...]\n";
+            return -1;
+        }
+        return emulate(args[1], std::vector<std::string>(args.begin() + 2, args.end()));
+    }
+
+    // fuzz program input on the emulator
+    if (args[0] == "--fuzz") {
+        if (args.size() < 2 || args.size() > 3) {
+            std::cerr << "Invalid Input. Usage: ./asm [-j THREADS] --fuzz CODEFILE.asm [SECONDS]\n";
+            return -1;
+        }
+        return fuzz(args[1], args.size() > 2 ? std::max(1, atoi(args[2].c_str())) : 10);
+    }
+
+    // profile microstore over a corpus of programs
+    if (args[0] == "--microprof") {
+        if (args.size() < 2) {
+            std::cerr << "Invalid Input. Usage: ./asm [-j THREADS] --microprof CODEFILE1.asm ...\n";
+            return -1;
+        }
+        return microprofile(std::vector<std::string>(args.begin() + 1, args.end()));
+    }
+
+    // disassemble each binary file to a code file of the same name
+    if (args[0] == "--disasm") {
+        int failed = 0;
+        for (int i=1; i < (int)args.size(); i++) {
+            infilename = args[i];
+            outfilename = std::filesystem::path(infilename).replace_extension(".asm").string();
+            if (outfilename == infilename) outfilename += ".asm";
+            if (!disassemble(infilename, outfilename)) failed++;
+        }
+        std::cout << std::dec << (args.size() - 1 - failed) << " of " << (args.size() - 1) << " files disassembled.\n";
+        return failed ? -1 : 0;
+    }
+
+    // batch mode - assemble each code file to a binary file of the same name
+    if (args[0] == "--batch") return batch(std::vector<std::string>(args.begin() + 1, args.end()));
+
+    // benchmark batch mode file I/O
+    if (args[0] == "--iobench") return iobench(args.size() > 1 ? std::max(1, atoi(args[1].c_str())) : 10000);
+
     // display help if requested
-    if (argc == 2) {
-        if (std::string(argv[1]) == "help") {
+    if (args.size() == 1) {
+        if (args[0] == "help") {
             std::cout << "\n\
 General Usage\n\
 -------------\n\
 To access help (this text): \"./asm help\"\n\n\
 To execute: \"./asm CODEFILE.asm [OUTPUTFILE.b]\"\n\
 Where CODEFILE.asm is the plaintext file containing ISA level instructions and OUTPUTFILE.b is the assembled binary output file that can be loaded into RAM modules in Logic Circuit. OUTPUTFILE is an optional parameter and will be named \"ram.b\" by default.\n\n\
+To assemble many files: \"./asm [-i IO] --batch CODEFILE1.asm CODEFILE2.asm ...\"\n\
+Each code file is assembled to a binary file of the same name with a \".b\" extension. A file that fails to assemble does not stop the batch. Files are read ahead of the assembler and written behind it with many in flight, using IO \"uring\" (io_uring, the default on Linux), \"threads\" (a pool of threads with blocking calls, used where io_uring is unavailable) or \"sync\" (each file read and written in turn). Failures to write an out file are reported at the end of the batch.\n\n\
+To disassemble: \"./asm [-b BASE] [-r] --disasm FILE1.b FILE2.b ...\"\n\
+Each binary file (dense format) is disassembled to a code file of the same name with a \".asm\" extension, which assembles back to the same bytes. BASE is the address of the first byte in hex (default 00). Bytes are decoded linearly as instructions wherever possible, or with -r only along the control flow from the first byte. Other bytes are written as @byte data. Branch and jump targets are given labels.\n\n\
+To verify round trips: \"./asm [-j THREADS] [-g COUNT] [-r] --roundtrip [CODEFILE1.asm ...]\"\n\
+Each code file, and COUNT randomly generated programs, are assembled, disassembled and assembled again in parallel on THREADS threads (default one per core), checking both images are identical. Each mismatch is reduced to a minimal reproducer written to rt_fail_N.asm. The throughput of the assembler and disassembler over the corpus is reported.\n\n\
+To run: \"./asm [-c] --run CODEFILE.asm [INPUT1 INPUT2 ...]\"\n\
+The code file is assembled and run on the ISA emulator until it halts (HLT, or WTI with no input left). Each INPUT is a hex byte supplied to WTI in order. The bytes written to the output register, the instructions executed, the cycles taken (using the cost model of the target profile) and the number of overlay swaps are reported. With -c (also for --fuzz) cycles are counted as the hardware takes them: the opcode fetch plus the length of each instruction's microroutine, from \"cycles.conf\" (see below).\n\n\
+To fuzz program input: \"./asm [-j THREADS] --fuzz CODEFILE.asm [SECONDS]\"\n\
+The code file is assembled and run on the emulator for SECONDS (default 10) on THREADS threads (default one per core) with input bytes mutated from a corpus. Inputs that reach a new jump/branch edge, or a new hit count bucket of one, are kept in the coverage corpus, and the slowest inputs in the cycles corpus. Inputs that fault (invalid opcode) or hang (100000 instructions) are reported. All are saved in CODEFILE.fuzz/ (coverage/, cycles/, faults/, hangs/) as hex bytes to pass to --run, and reused as seeds by the next run.\n\n\
+To serve editors: \"./asm [-t NAME] --lsp\"\n\
+Runs a language server on stdin/stdout (Language Server Protocol, incremental sync). Open documents are assembled as they are edited, with errors and warnings published as diagnostics. Go-to-definition and find-references work on labels and variables, and the address, size and cycle cost of each line are shown as inlay hints and on hover.\n\n\
+To benchmark the line scanner: \"./asm --scanbench [MB]\"\n\
+Generates MB megabytes (default 8) of random programs and reports the throughput of the line scanner (scalar, SSE2 and AVX2 as supported by the CPU), bulk case folding, the lexer and the assembler.\n\n\
+To fuzz the assembler for slow inputs: \"./asm [-j THREADS] --perffuzz [SECONDS]\"\n\
+Mutates generated programs for SECONDS (default 10) towards pathological code (long lines, runs of ':', '=', '#' and other characters the lexer and parser look for, comment blocks, repeated lines), keeping the inputs that cost the most per byte. A budget of a fixed cost plus a cost per byte, in time and in memory allocations (counted only in a build with -DPERF_ALLOCS), is fitted to generated programs first. Any input over 8 times its budget (time is judged from 4 KB) is saved to perf_fail_N.asm, with its cost in the first line.\n\n\
+To benchmark batch file I/O: \"./asm --iobench [N]\"\n\
+Writes N (default 10000) random programs to a temporary directory and reports the files per second of each kind of batch file I/O, reading and writing the files alone and assembling them as a batch.\n\n\
+To profile microcode: \"./asm [-j THREADS] --microprof CODEFILE1.asm CODEFILE2.asm ...\"\n\
+Each code file is assembled and run on the emulator in timing mode (see -c under --run) on THREADS threads (default one per core), once with no input and once with each input saved by --fuzz in CODEFILE.fuzz/coverage and CODEFILE.fuzz/cycles. The runs of each microroutine (and of its branch taken), and the cycles they take, are totalled over all runs and listed by instruction pattern and MPC address, costliest first, followed by the most executed microaddresses. A routine is taken to execute its words in order from its MPC address, and the opcode fetch the words from MPC 0.\n\n\
+To link microcode: \"./asm [-m FIELDS] --microlink ROUTINES.mc [ROM.img] [MAPPING.conf]\"\n\
+Each microroutine in ROUTINES.mc (an instruction pattern followed by ':' and optionally a fixed MPC address, then one hex control word per line) is placed in the microstore. A routine whose words are the final words of another routine shares them instead of being stored again, and the rest are packed without gaps. The microstore is written as a Logisim image to ROM.img (default microstore.img) and the MPC address of each instruction to MAPPING.conf (default mapping.conf).\n\
+With -m, each routine is first compacted using the control word fields defined in FIELDS, one per line as \"NAME : HIGH LOW [reads RES ...] [writes RES ...] [sequence]\" (bit positions in hex, RES any name for a register, bus or flag the field's microoperation uses, sequence for fields that change the MPC). Microoperations are merged into the earliest control word after those they depend on (that write what they read or write, or use the same field), so routines shrink without changing what they do. Words using a sequence field stay last in their control word, and zero words (wait cycles) and words with bits outside every field are not merged. Entries in cycles.conf for compacted routines should be updated to match.\n\n\
+Target profiles: \"-t NAME1,NAME2,...\" may be given before any of the above to select hardware variants defined in \"targets.conf\" (see Target Profiles below, default profile \"default\"). With several profiles the program is assembled once and written once per profile, with the profile name added to the out file name (eg. ram.nocin.b) and the relative branches re-encoded for each.\n\n\
+Defines: \"-D NAME\" or \"-D NAME=VALUE\" (hex, default 1) may be given before any of the above to define a name for @if conditions, eg. \"./asm -D DEBUG code.asm\".\n\n\
+Output format: \"-f FORMAT\" may be given before any of the above, where FORMAT is one of:\n\
+    dense       raw bytes from the lowest to the highest populated address, gaps padded with 0x00 (default)\n\
+    regions     only populated bytes, as records of [start address] [length (00 = 256)] [bytes ...]\n\
+                (start address is 2 bytes, low byte first, in 16-bit address mode)\n\
+    logisim     Logisim \"v2.0 raw\" image from address 0x00, runs of bytes compressed as \"count*value\"\n\
+    ihex        Intel HEX\n\
+In batch mode the out files are named with extension .b, .b, .img or .hex respectively.\n\n\
 Note: ensure the \"mapping.conf\" file is in the same directory as this executable and contains the mappings from each ISA level Mnemonic + Operand Pattern to the corresponding MPC address for each supported instruction.\n\
 ie. \"ADD A, X : 4C\" in the mapping file indicates to the assembler that ADD A, X begins at MPC address 0x4C.\n\n\
 Writing Code Files\n\
@@ -241,10 +871,10 @@ Notes:\n\
             Thus, 'BR FC' will branch to an address equal to PC - 4\n\
 \n\
     * If the outgoing carry out signal from the PSW is not fed directly into the \n\
-        carry in (Cin) of the ALU, then modify the \"ALU_CARRY_ADJUST\" preprocessor\n\
-        macro to 1 (instead of 2) and recompile this assembler. This ensures that\n\
-        the offset for a back branch (branching to a label before the current\n\
-        instruction) is computed correctly.\n\
+        carry in (Cin) of the ALU, then select a target profile with a carry adjust\n\
+        of 1 (instead of 2), see Target Profiles below. This ensures that the offset\n\
+        for a back branch (branching to a label before the current instruction) is\n\
+        computed correctly.\n\
 \n\
 Assembler Directives:\n\
     - Specified by '@' followed by directive name\n\
@@ -253,66 +883,227 @@ Assembler Directives:\n\
         program accordingly. Default is 0x00.\n\
         \n\
         Usage: @base_addr=1F        // sets base address to 0x1F\n\
+    - 'org' - continues the program at the given address, starting a new region of memory.\n\
+        Only populated bytes are written in the 'regions' output format (see -f).\n\
+        \n\
+        Usage: @org=F0              // following code is placed from 0xF0\n\
+    - 'var' - declares a named variable whose address is assigned by the assembler. Must be\n\
+        declared before use. Reference as '$name' (direct address) or 'name' (address as\n\
+        an immediate). Variables never live at the same time may share a byte, and the\n\
+        program, stack region and I/O registers are never assigned.\n\
+        \n\
+        Usage: @var=sum             // declares variable 'sum'\n\
+               MOV $sum, 12         // (sum) = 0x12\n\
+    - 'macro' / 'endm' - defines a reusable instruction sequence with optional parameters.\n\
+        In the body '\\param' is replaced by an argument and '\\@' by a number unique to the\n\
+        expansion (for local labels). Macros may invoke other macros (max depth 16).\n\
+        \n\
+        Usage: @macro BRV tmp, lbl     // branch to lbl if V flag set\n\
+                   mov \\tmp, $C8\n\
+                   and \\tmp, 4\n\
+                   cmp \\tmp, 4\n\
+                   brz \\lbl\n\
+               @endm\n\
+               BRV $51, exit\n\
+    - 'include' - inserts another code file (path relative to the including file). Each file\n\
+        is included at most once per program, and is only read once when assembling a batch.\n\
+        \n\
+        Usage: @include \"lib/flags.asm\"\n\
+    - 'byte' / 'fill' / 'data' / 'incbin' - place data (eg. lookup tables) at the current address.\n\
+        \n\
+        Usage: @byte 01, 2F, aLabel     // listed bytes, hex or label address\n\
+               @fill 10, FF             // 0x10 bytes of 0xFF\n\
+               @data 00112233 44556677  // hex digit pairs, whitespace ignored\n\
+               @incbin \"table.bin\"      // contents of binary file\n\
+    - 'if' / 'else' / 'endif' - assemble the following lines only if a constant expression is\n\
+        non-zero. Expressions use hex numbers, names defined with -D, directives assigned\n\
+        earlier (eg. base_addr), ( ) ! - + & | == != < <= > >= && || and defined(NAME).\n\
+        Names that are not defined are 0. Conditionals may be nested, but not used in macros.\n\
+        \n\
+        Usage: @if DEBUG && base_addr < 80\n\
+                   mov $C0, $50             // display only in debug builds\n\
+               @else\n\
+                   nop\n\
+               @endif\n\
+\n\
+Stack Analysis:\n\
+    - After assembly the max stack depth is reported for the program entry point and for\n\
+        every subroutine (JSR target). PSH/JSR push 1 byte, POP/RTS pop 1 byte.\n\
+    - Recursion and unbalanced PSH/POP paths are reported as warnings\n\
+    - If the stack pointer is loaded with an immediate (LSP X), the minimal stack region\n\
+        below X is reported and checked for overlap with the program and I/O registers\n\
+\n\
+16-bit Address Mode:\n\
+    - Patterns in mapping.conf may declare 2 byte operands by doubling the letter: 'XX' for\n\
+        an immediate, 'AA'/'BB' for a direct address (eg. \"MOV AA, X : C0\"). 2 byte operands\n\
+        are stored low byte first.\n\
+    - A numeric operand above FF is 2 bytes ('$0456', '1234'). Written with 3 or 4 digits\n\
+        below that ('$0050'), it is 2 bytes only if the profile has more than 256 bytes of\n\
+        memory and a wide form is mapped, otherwise 1 byte.\n\
+    - If the target profile has more than 256 bytes of memory, labels, variables and JMP/JSR\n\
+        targets are 2 bytes, and base_addr/org take addresses up to FFFF. Relative branch\n\
+        offsets stay 1 byte (-80 to 7F), anything further away must use JMP.\n\
+\n\
+Overlays:\n\
+    - \"@window=XX\" sets the overlay window. Code between \"@overlay NAME\" and \"@endoverlay\"\n\
+        is assembled at the window and written to its own image (eg. ram.NAME.b)\n\
+    - Writing N to the bank-switch register (I/O base + 0C, ie. $CC) loads overlay N (in order\n\
+        of appearance) into the window. A JSR into an overlay from outside it does this through\n\
+        a generated thunk that restores the caller's overlay on return. Jumps and branches into\n\
+        an overlay from outside it are errors.\n\
+    - The number of swaps along each call path is reported after assembly\n\
+\n\
+Target Profiles:\n\
+    - Each line of \"targets.conf\" describes a hardware variant (all values hex):\n\
+        NAME : CARRY IO_FIRST IO_LAST MEM_SIZE FETCH OPERAND\n\
+        ie. the back branch carry adjust, the memory mapped I/O registers, the size of memory\n\
+        and the cost model (cycles to fetch an opcode, and each operand byte)\n\
+    - The built-in \"default\" profile is: 2 C0 CB 100 3 1\n\
+    - Variables are placed clear of the I/O registers and within the memory of every\n\
+        selected profile, so the images of all profiles differ only in relative branches\n\
+\n\
+Microcode Timing:\n\
+    - Each line of \"cycles.conf\" gives the cycles of the microroutine at an MPC address of\n\
+        mapping.conf, and optionally when its branch is taken (all values hex):\n\
+        MPC : CYCLES [TAKEN]\n\
+    - A routine with no line is assumed to run up to the next mapped MPC address\n\
     \n";
             return 0;
         }
     }
 
-    else if (argc > 3) {
+    else if (args.size() > 2) {
         std::cerr << "Invalid Input. Too Many Arguments:\n\
         Program Usage: ./asm code.txt [out.b]\n";
         return -1;
     }
 
     // fetch args
-    infilename = std::string(argv[1]);
-    if (argc == 3) outfilename = std::string(argv[2]);
+    infilename = args[0];
+    if (args.size() == 2) outfilename = args[1];
 
-    // parse input file
-    std::ifstream in(infilename);
-    if (!in.is_open()) {
-        std::cerr << "Error opening " << infilename << ".\n";
-        return -1;
+    return assemble(infilename, outfilename) ? 0 : -1;
+}
+
+// assemble code file to out file, returns false on error
+bool assemble(std::string& infilename, std::string& outfilename, const std::string* text) {
+    std::vector<Region> image;
+    Unit unit;                      // code read by the batch reader, not cached
+    std::shared_ptr<const Unit> cached;                     // code file, held while its program is listed
+    try {
+        if (text) {
+            unit.path = std::filesystem::absolute(infilename).lexically_normal().string();
+            lexbuffer(*text, unit);
+            for (auto& l : unit.lines) l.file = &unit.path;
+            if (!build(unit, image)) return false;
+        }
+        else if (!build(*(cached = lex(infilename)), image)) return false;
     }
-    std::ofstream out(outfilename, std::ios::binary);
-    if (!out.is_open()) {
-        std::cerr << "Error creating " << outfilename << ".\n";
-        return -1;
+    catch (AsmError&) {
+        return false;
     }
 
-    // load mapping config if file present
-    std::ifstream conf(confFilename);
-    if (conf.is_open()) {
-        load(conf);
-        conf.close();
+    // write program once per target profile - only relative branches differ between them
+    listing();
+    for (int i=0; i < (int)targets.size(); i++) {
+        std::string name = outfilename;
+        if (targets.size() > 1) {
+            std::filesystem::path path(outfilename);
+            name = path.replace_extension("." + targets[i]->name + path.extension().string()).string();
+        }
+        try {
+            if (i > 0) image = retarget(*targets[i]);
+        }
+        catch (AsmError&) {
+            std::cerr << "Failed to assemble for profile " << targets[i]->name << ".\n";
+            return false;
+        }
+        int size = writeimage(name, image);
+        if (size < 0) return false;
+        std::cout << '\n' << infilename << " successfully assembled to " << name << " in " << std::dec << size << " bytes";
+        if (targets.size() > 1) std::cout << " (profile " << targets[i]->name << ", " << cost() << " cycles straight-line)";
+        std::cout << ".\n";
+
+        // one image per overlay, named after the overlay
+        for (int k=0; k < (int)overlays.size(); k++) {
+            std::filesystem::path path(name);
+            std::string ovlname = path.replace_extension("." + overlays[k] + path.extension().string()).string();
+            if ((size = writeimage(ovlname, layout(k+1))) < 0) return false;
+            std::cout << "Overlay " << overlays[k] << " written to " << ovlname << " in " << std::dec << size << " bytes.\n";
+        }
     }
+    return true;
+}
 
-    // parse labels
-    parse(in, out, infilename, outfilename, false);
+// re-encode relative branches of assembled program for another target profile, returns its memory image
+std::vector<Region> retarget(const Profile& p) {
+    profile = &p;
+    for (auto& ins : prog)
+        if (ins.dest >= 0) ins.ops[0] = encodetarget(ins.mnemonic, ins.addr, ins.dest);
+    return layout();
+}
 
-    // parse code
-    std::cout << "\nAddr.\tByte\tInstr.\n";
-    in.clear();
-    in.seekg(0, in.beg);
-    parse(in, out, infilename, outfilename, true);
+// cycles to execute every instruction of the assembled program once, under the cost model of the current profile
+int cost() {
+    int cycles = 0;
+    for (auto& ins : prog)
+        if (ins.data.empty()) cycles += profile->fetch + (length(ins) - 1) * profile->operand;
+    return cycles;
+}
 
-    in.close();
-    out.close();
+// assemble code held in memory, returns false on error
+bool assembletext(const std::string& text, std::vector<Region>& image) {
+    Unit unit;
+    try {
+        lexbuffer(text, unit);
+    }
+    catch (AsmError&) {
+        return false;
+    }
+    for (auto& l : unit.lines) l.file = &unit.path;
+    return build(unit, image);
+}
 
-    return 0;
+// assemble parsed unit into memory image, returns false on error
+bool build(const Unit& unit, std::vector<Region>& image) {
+    std::vector<Line> src;
+    reset();
+    profile = targets.front();
+    try {
+        // read code, expanding includes and macros
+        included.insert(unit.path);
+        splice(unit, src, 0);
+
+        // redirect calls into overlays
+        overlay(src);
+
+        // parse labels
+        parse(src, false);
+
+        // parse code
+        parse(src, true);
+
+        // report stack usage and place variables
+        stackcheck();
+        swapreport();
+        allocvars();
+        image = layout();
+    }
+    catch (AsmError&) {
+        return false;
+    }
+    return true;
 }
 
 // load instruction mapping configuration
 void load(std::ifstream& conf) {
     std::string line;
     int linenum = 0;
-    std::regex rgx("^.*:");     // match anything before a colon on a line
-    std::smatch match;
+    size_t colon;               // last colon on line, ending the instruction pattern
     std::string instr;
     std::string mnemonic;
     std::string map;
     uint32_t icode;
-    uint32_t buffer;
     char c;
     int numops;
     unsigned char optype[2] = {0,0};
@@ -325,9 +1116,9 @@ void load(std::ifstream& conf) {
         if (line == "")     continue;
         if (line[0] == '#') continue;
 
-        if (std::regex_search(line, match, rgx)) {
-            instr = std::string(match[0]).substr(0, match[0].length()-1);
-            map = line.substr(instr.length()+1, line.length() - instr.length());
+        if ((colon = line.rfind(':')) != std::string::npos) {
+            instr = line.substr(0, colon);
+            map = line.substr(colon + 1);
             instr = trim(instr);
             map = trim(map);
 
@@ -353,12 +1144,12 @@ void load(std::ifstream& conf) {
                     }
                     continue;
                 }
-                if (c == 'A' || c == 'B') {     // direct mem address
-                    optype[numops] = 2;
+                if (c == 'A' || c == 'B') {     // direct mem address (doubled for 2 byte address)
+                    optype[numops] = optype[numops] == 2 ? 4 : 2;
                     continue;
                 }
-                if (c == 'X') {
-                    optype[numops] = 1;
+                if (c == 'X') {                 // immediate (doubled for 2 byte immediate)
+                    optype[numops] = optype[numops] == 1 ? 3 : 1;
                     continue;
                 }
                 std::cerr << "Error: Invalid operand type specified: '" << c << "' [line " << linenum << "]\n";
@@ -368,33 +1159,21 @@ void load(std::ifstream& conf) {
             else if (optype[0] != 0)    numops = 1;
 
             // construct instruction code
-            icode = 0;
-            buffer = 0;
-            for (int i=0; i < mnemonic.length(); i++) {
-                if (i > 2) {
-                    std::cerr << "Error: Invalid Mnemonic: \"" << mnemonic << "\" [line " << linenum << "]\n";
-                    conf.close();               // close file
-                    exit(EXIT_FAILURE);
-                }
-                buffer = mnemonic[i];           // insert mnemonic values into high order 24 bits
-                buffer <<= (8 * (3-i));
-                icode |= buffer;
+            if (mnemonic.length() > 3) {
+                std::cerr << "Error: Invalid Mnemonic: \"" << mnemonic << "\" [line " << linenum << "]\n";
+                conf.close();                   // close file
+                exit(EXIT_FAILURE);
             }
-            buffer = optype[0];
-            buffer <<= 4;
-            buffer |= (optype[1] & 0x0F);
-            icode |= buffer;
+            icode = icodeof(mnemonic, optype[0], optype[1]);
 
             // read MPC address
             i = 0;
             mpc = 0;
             while (i < map.length()) {
-                c = toupper(map[i++]);
-                if ((c >= 48 && c <= 57) || (c >= 65 && c <= 70)) {     // 0-9 or A-F
-                    val = c - 48;               // assume digit
-                    if (c > 64) val = c - 55;   // convert if char
+                c = map[i++];
+                if ((val = hexval[c]) < 16) {   // 0-9 or A-F
                     mpc <<= 4;          // calculate operand value
-                    mpc |= (val & 0x0F);
+                    mpc |= val;
                 }
                 else {
                     std::cerr << "Error: Invalid MPC address: \"" << c << "\" [line " << linenum << "]. Address must be in hexadecimal.\n";
@@ -416,174 +1195,806 @@ void load(std::ifstream& conf) {
     return;
 }
 
-// parse code file
-void parse(std::ifstream& in, std::ofstream& out, std::string& infilename, std::string& outfilename, bool write) {
+// load target profiles configuration, lines of 'NAME : CARRY IO_FIRST IO_LAST MEM_SIZE FETCH OPERAND'
+void loadprofiles(std::ifstream& conf) {
+    std::string line, name, field;
+    int linenum = 0;
+    int v[6];
 
-    // local vars
-    static std::unordered_map<std::string,unsigned char> lblmap;   // maps labels to addresses
-    std::string line;           // current line in code file being parsed
-    int linenum = 1;
-    std::regex lblrgx("^.*:");  // match any string preceding a colon [simplistic and not foolproof]
-    std::regex dirrgx("^.*=");  // match any string preceding an equals sign for directive pattern
-    std::smatch match;          // pattern match array    
-    int caddr = 0;              // address of current assembled instruction / operand
-    int maddr = 0;              // memory address
-    uint32_t icode;             // instruction code
-    uint32_t buffer;
-    std::string mnemonic;       // parsed mnemonic
-    std::string lbl;            // parsed label
-    int i;
-    char c; 
-    int numops;                 // number of operands in parsed instruction
-    unsigned char ops[2] = {0,0};
-    unsigned char optype[2] = {0,0};
-    unsigned char val;
-    unsigned char mpc;          // mpc address
-    bool comment, sign;
+    while (getline(conf, line)) {
+        linenum++;
+        line = line.substr(0, line.find('#'));
+        line = trim(line);
+        if (line == "") continue;
 
-    if (adjustBase && write) {              // adjust base by parsed offset from first pass
-        caddr += directives["base_addr"];
-        adjustBase = false;
+        size_t colon = line.find(':');
+        std::istringstream fields(colon == std::string::npos ? "" : line.substr(colon + 1));
+        name = line.substr(0, colon == std::string::npos ? 0 : colon);
+        name = trim(name);
+        int n = 0;
+        while (n < 6 && fields >> field) {
+            v[n] = 0;
+            for (char c : field) {
+                if (hexval[c] > 15 || v[n] > 0xFFFF) {
+                    n = -1;
+                    break;
+                }
+                v[n] = (v[n] << 4) | hexval[c];
+            }
+            if (n++ < 0) break;
+        }
+        if (name == "" || n != 6 || fields >> field || v[1] > v[2] || v[3] < 1 || v[3] > 0x10000) {
+            std::cerr << "Error: Invalid target profile: \"" << line << "\" [line " << linenum << "]\n";
+            conf.close();
+            exit(EXIT_FAILURE);
+        }
+        profiles[name] = {name, v[0], v[1], v[2], v[3], v[4], v[5]};
     }
+}
+
+// load microroutine cycles configuration, lines of 'MPC : CYCLES [TAKEN]'
+void loadcycles(std::ifstream& conf) {
+    std::string line, field;
+    int linenum = 0;
+    int v[3];
 
-    while (getline(in, line)) {
+    while (getline(conf, line)) {
+        linenum++;
+        line = line.substr(0, line.find('#'));
         line = trim(line);
+        if (line == "") continue;
+
+        size_t colon = line.find(':');
+        std::istringstream fields(colon == std::string::npos ? "" : line.substr(0, colon) + ' ' + line.substr(colon + 1));
+        int n = 0;
+        while (n < 3 && fields >> field) {
+            v[n] = 0;
+            for (char c : field) {
+                if (hexval[c] > 15 || v[n] > 0xFFF) {
+                    n = -1;
+                    break;
+                }
+                v[n] = (v[n] << 4) | hexval[c];
+            }
+            if (n++ < 0) break;
+        }
+        if (n < 2 || fields >> field || v[0] > 0xFF) {
+            std::cerr << "Error: Invalid microroutine cycles: \"" << line << "\" [line " << linenum << "]\n";
+            conf.close();
+            exit(EXIT_FAILURE);
+        }
+        mcycles[v[0]] = {v[1], n > 2 ? v[2] : v[1]};
+    }
+}
+
+// true if line is the given directive (ie. '@name' followed by whitespace or end of line)
+bool isdirective(const std::string& line, const std::string& name) {
+    if (line.compare(0, name.length()+1, "@" + name) != 0) return false;
+    return line.length() == name.length()+1 || isspace(line[name.length()+1]);
+}
 
-        if (line == "") {       // skip blank lines
-            linenum++;
-            continue;   
+// split comma separated list, trimming each entry and dropping any trailing comment
+std::vector<std::string> splitargs(std::string str) {
+    std::vector<std::string> args;
+    std::string arg;
+    str = str.substr(0, str.find('#'));
+    if (trim(str) == "") return args;
+    size_t pos = 0, end;
+    do {
+        end = str.find(',', pos);
+        arg = str.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+        args.push_back(trim(arg));
+        pos = end + 1;
+    } while (end != std::string::npos);
+    return args;
+}
+
+// append line of code to source, expanding it if it is a macro invocation
+void addline(std::string text, int linenum, const std::string* file, std::vector<Line>& src, int depth) {
+    std::string line = trim(text);
+    std::string name = line.substr(0, line.find_first_of(" \t"));
+    auto m = macros.find(name);
+    if (m == macros.end()) {
+        src.push_back({text, linenum, file});
+        return;
+    }
+    if (depth >= MACRO_DEPTH) {
+        *errout << "Error: Macro expansion exceeds max depth of " << MACRO_DEPTH << ": \"" << name << "\" [line " << linenum << "]\n";
+        throw AsmError();
+    }
+    std::vector<std::string> args = splitargs(line.substr(name.length()));
+    if (args.size() != m->second->params.size()) {
+        *errout << "Error: Macro \"" << name << "\" expects " << m->second->params.size() << " argument(s) [line " << linenum << "]\n";
+        throw AsmError();
+    }
+    std::string id = std::to_string(expansions++);
+    for (auto& tokens : m->second->body) {
+        text = "";
+        for (auto& t : tokens) {
+            if (t.param >= 0)       text += args[t.param];
+            else if (t.param == -2) text += id;
+            else                    text += t.text;
         }
+        addline(text, linenum, file, src, depth+1);
+    }
+}
 
-        if (line[0] == '#') {   // skip past lines only containing a comment
-            linenum++;
-            continue;       
+// read code file into parsed unit - reuses cached unit if file is unchanged
+std::shared_ptr<const Unit> lex(const std::string& path) {
+    std::error_code ec;
+    std::string key = std::filesystem::canonical(path, ec).string();
+    std::ifstream in(key);
+    if (ec || !in.is_open()) {
+        *errout << "Error opening " << path << ".\n";
+        throw AsmError();
+    }
+    auto mtime = std::filesystem::last_write_time(key, ec);
+    {
+        std::lock_guard<std::mutex> lock(unitlock);
+        auto cached = units.find(key);
+        if (cached != units.end() && cached->second.unit->mtime == mtime) {
+            cached->second.used = ++unitlookups;
+            return cached->second.unit;
         }
+    }
 
-        // match assembler directive
-        if (line[0] == '@') {
-            if (!write) {            // process only on first pass
-                if (std::regex_search(line, match, dirrgx)) {
-                    lbl = std::string(match[0]).substr(1, match[0].length()-2);                 // repurposing lbl and mnemonic strings temporarily
-                    mnemonic = line.substr(lbl.length()+2, line.length() - lbl.length());
-                    lbl = trim(lbl);
-                    mnemonic = trim(mnemonic);
-                    if (directives.find(lbl) != directives.end()) {
-                        i = 0;
-                        while (i < mnemonic.length()) {
-                            c = toupper(mnemonic[i++]);
-                            if (c == ' ') continue;     // skip past blank space     
-                            if (c == '#') break;        // skip inline comments
-                            if ((c >= 48 && c <= 57) || (c >= 65 && c <= 70)) {     // 0-9 or A-F
-                                val = c - 48;               // assume digit
-                                if (c > 64) val = c - 55;   // convert if char
-                                mpc <<= 4;          // calculate operand value
-                                mpc |= (val & 0x0F);
-                            }
-                            else {
-                                std::cerr << "Error: Invalid hex value: \"" << mnemonic << "\" [line " << linenum << "]\n";
-                                goto err;
-                            }
-                        }
-                        directives[lbl] = mpc;      // store value under directive label
-                        if (lbl == "base_addr") {
-                            std::cout << "Address Offset = 0x" << std::hex << (int)mpc <<'\n';
-                            caddr += mpc;       // adjust base address
-                            adjustBase = true;
-                        }
-                    }
-                    else {
-                        std::cerr << "Error: Invalid assembler directive: \"" << line << "\" [line " << linenum << "]\n";
-                        goto err;
-                    }
+    std::shared_ptr<Unit> unit = std::make_shared<Unit>();
+    unit->path = key;
+    unit->mtime = mtime;
+    lexstream(in, *unit);
+    for (auto& l : unit->lines) l.file = &unit->path;
+
+    std::lock_guard<std::mutex> lock(unitlock);
+    units[key] = {unit, ++unitlookups};                     // programs still using an older unit keep it
+    if (units.size() > UNIT_CACHE)
+        units.erase(std::min_element(units.begin(), units.end(), [](const auto& a, const auto& b) { return a.second.used < b.second.used; }));
+    return unit;
+}
+
+// read code into unit, tokenizing macro definitions
+void lexstream(std::istream& in, Unit& unit) {
+    lexbuffer(std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>()), unit);
+}
+
+// tokenize code held in memory into unit
+void lexbuffer(const std::string& buf, Unit& unit) {
+    std::string line, text;
+    int linenum = 0;
+    Macro* def = nullptr;           // macro currently being defined
+    size_t i, j;
+    std::vector<std::pair<int,bool>> conds;     // open @if/@else lines (index, is @else), innermost last
+    std::vector<ScanBlock> blocks;
+    scan(buf.data(), buf.length(), blocks);
+
+    for (size_t pos = 0, eol; pos < buf.length(); pos = eol + 1) {     // split at line ends found by scanner
+        eol = scanfirst(blocks, SCAN_EOL, pos, buf.length());
+        text.assign(buf, pos, eol - pos);
+        linenum++;
+        line = trim(text);
+
+        if (!def && (isdirective(line, "if") || isdirective(line, "else") || isdirective(line, "endif"))) {
+            int at = unit.lines.size();
+            if (!isdirective(line, "if")) {             // match to innermost open conditional
+                if (conds.empty() || (conds.back().second && isdirective(line, "else"))) {
+                    *errout << "Error: " << (conds.empty() ? "@else/@endif without @if" : "Second @else for @if") << " [line " << linenum << "]\n";
+                    throw AsmError();
                 }
-                else {      // all directives must match directive pattern (id=value) at the moment [if this changes, remove following error]
-                    std::cerr << "Error: Invalid assembler directive assignment: \"" << line << "\" [line " << linenum << "]\n";
-                    goto err;
+                unit.branches[conds.back().first] = at;
+                conds.pop_back();
+            }
+            if (!isdirective(line, "endif")) {
+                if (conds.size() >= COND_DEPTH) {
+                    *errout << "Error: Conditionals nested deeper than " << COND_DEPTH << " [line " << linenum << "]\n";
+                    throw AsmError();
                 }
+                conds.push_back({at, isdirective(line, "else")});
             }
+            unit.lines.push_back({text, linenum, nullptr});
             continue;
         }
 
-        // match label
-        if (std::regex_search(line, match, lblrgx)) {
-            if (!write) {
-                lbl = std::string(match[0]).substr(0, match[0].length()-1);
-                //if (adjustBase) {
-                //    caddr += directives["base_addr"];
-                //    adjustBase = false;
-                //}
-                //std::cout << "parsed label '" << lbl << "' to address " << std::hex << caddr << "\n";
-                lblmap[lbl] = caddr;    // cache mapped label and address pair in hash map
+        if (isdirective(line, "macro")) {
+            if (def) {
+                *errout << "Error: Nested macro definition [line " << linenum << "]\n";
+                throw AsmError();
+            }
+            line = line.substr(6);
+            line = trim(line);
+            std::string name = line.substr(0, line.find_first_of(" \t#")), key = name;
+            if (name == "") {
+                *errout << "Error: Invalid macro name [line " << linenum << "]\n";
+                throw AsmError();
+            }
+            if (unit.macros.find(key) != unit.macros.end())         // eg. defined on both sides of @if, duplicates are caught by splice()
+                key += ' ' + std::to_string(linenum);
+            def = &unit.macros[key];
+            def->params = splitargs(line.substr(name.length()));
+            def->linenum = linenum;
+            unit.lines.push_back({"@macro " + key, linenum, nullptr});
+            continue;
+        }
+        if (isdirective(line, "endm")) {
+            if (!def) {
+                *errout << "Error: @endm without @macro [line " << linenum << "]\n";
+                throw AsmError();
             }
-            linenum++;
+            def = nullptr;
+            continue;
+        }
+        if (!def) {
+            unit.lines.push_back({text, linenum, nullptr});
             continue;
         }
 
-        // if not label, then must be instruction
+        // tokenize macro body line
+        std::vector<Token> tokens;
         i = 0;
-        mnemonic = "";
-        lbl = "";
-        numops = 0;
-        ops[0] = 0;
-        ops[1] = 0;
-        optype[0] = 0;
-        optype[1] = 0;
-        comment = false;
-        sign = false;
-        while (i < line.length() && !comment) {     // read mnemonic 
-            c = line[i++];
-            if (c != ' ') mnemonic += toupper(c);
-            else if (c == '#') comment = true;
-            else break;
+        while ((j = text.find('\\', i)) != std::string::npos) {
+            if (j > i) tokens.push_back({-1, text.substr(i, j - i)});
+            if (j+1 < text.length() && text[j+1] == '@') {
+                tokens.push_back({-2, ""});
+                i = j + 2;
+                continue;
+            }
+            i = ++j;
+            while (j < text.length() && (isalnum(text[j]) || text[j] == '_')) j++;
+            std::string param = text.substr(i, j - i);
+            int k = 0;
+            while (k < (int)def->params.size() && def->params[k] != param) k++;
+            if (k == (int)def->params.size()) {
+                *errout << "Error: Unknown macro parameter: \"\\" << param << "\" [line " << linenum << "]\n";
+                throw AsmError();
+            }
+            tokens.push_back({k, ""});
+            i = j;
         }
-        //std::cout << "Mnemonic: '" << mnemonic << "'\n"; 
-        if (write) {           // handle jump/br instructions
-            if (jmpcodes.find(mnemonic) != jmpcodes.end()) {        // mnemonic is a valid jump/branch
-                numops = 1;     // all jmp/br instr. have a single immediate operand
-                optype[0] = 1;
+        if (i < text.length()) tokens.push_back({-1, text.substr(i)});
+        def->body.push_back(tokens);
+    }
+    if (def) {
+        *errout << "Error: Unterminated macro definition [line " << def->linenum << "]\n";
+        throw AsmError();
+    }
+    if (!conds.empty()) {
+        *errout << "Error: Unterminated @if [line " << unit.lines[conds.back().first].linenum << "]\n";
+        throw AsmError();
+    }
+}
 
-                // Since operand can be represented in code as either an immediate
-                // or a label, both are computed in parallel, then a choice is made 
-                // afterward
-                while (i < line.length() && !comment) {     // parse rest of line
-                    c = line[i++];
-                    if (c == '#') {
-                        comment = true;
-                        continue;
+// value of constant expression in @if at pos, for operators binding tighter than minprec (precedence climbing)
+int condexpr(const std::string& expr, size_t& pos, int minprec, int linenum) {
+    static const std::vector<std::pair<std::string,int>> binops ({      // longest first, so '<=' is not read as '<'
+        {"||", 1}, {"&&", 2}, {"==", 3}, {"!=", 3}, {"<=", 4}, {">=", 4}, {"<", 4}, {">", 4},
+        {"|", 5}, {"&", 6}, {"+", 7}, {"-", 7}
+    });
+    auto fail = [&](const std::string& msg) {
+        *errout << "Error: " << msg << " in condition: \"" << expr << "\" [line " << linenum << "]\n";
+        throw AsmError();
+    };
+    auto skipws = [&]() { while (pos < expr.length() && isspace(expr[pos])) pos++; };
+    auto word = [&]() {
+        size_t start = pos;
+        while (pos < expr.length() && (isalnum(expr[pos]) || expr[pos] == '_')) pos++;
+        return expr.substr(start, pos - start);
+    };
+
+    // operand
+    int val;
+    skipws();
+    if (pos >= expr.length()) fail("Missing operand");
+    if (expr[pos] == '(') {
+        pos++;
+        val = condexpr(expr, pos, 0, linenum);
+        skipws();
+        if (pos >= expr.length() || expr[pos++] != ')') fail("Missing ')'");
+    }
+    else if (expr[pos] == '!' && expr.compare(pos, 2, "!=") != 0) {
+        pos++;
+        val = !condexpr(expr, pos, 8, linenum);
+    }
+    else if (expr[pos] == '-') {
+        pos++;
+        val = -condexpr(expr, pos, 8, linenum);
+    }
+    else {
+        std::string name = word();
+        if (name == "defined") {
+            skipws();
+            bool paren = pos < expr.length() && expr[pos] == '(';
+            if (paren) pos++;
+            skipws();
+            name = word();
+            skipws();
+            if (name == "" || (paren && (pos >= expr.length() || expr[pos++] != ')'))) fail("Invalid defined()");
+            val = symbols.find(name) != symbols.end();
+        }
+        else if (symbols.find(name) != symbols.end()) val = symbols[name];
+        else if (name == "") fail("Invalid operand");
+        else if ((val = hexword(name)) < 0) val = 0;        // undefined name
+    }
+
+    // binary operators
+    while (true) {
+        skipws();
+        auto op = binops.begin();
+        while (op != binops.end() && expr.compare(pos, op->first.length(), op->first) != 0) op++;
+        if (op == binops.end() || op->second <= minprec) return val;
+        pos += op->first.length();
+        int rhs = condexpr(expr, pos, op->second, linenum);
+        switch (op->first[0] * 256 + (op->first.length() > 1 ? op->first[1] : 0)) {
+            case '|'*256+'|': val = val || rhs; break;
+            case '&'*256+'&': val = val && rhs; break;
+            case '='*256+'=': val = val == rhs; break;
+            case '!'*256+'=': val = val != rhs; break;
+            case '<'*256+'=': val = val <= rhs; break;
+            case '>'*256+'=': val = val >= rhs; break;
+            case '<'*256:     val = val < rhs; break;
+            case '>'*256:     val = val > rhs; break;
+            case '|'*256:     val = val | rhs; break;
+            case '&'*256:     val = val & rhs; break;
+            case '+'*256:     val = val + rhs; break;
+            case '-'*256:     val = val - rhs; break;
+        }
+    }
+}
+
+// evaluate condition of @if line
+bool condition(const std::string& line, int linenum) {
+    std::string expr = line.substr(3, line.find('#') == std::string::npos ? std::string::npos : line.find('#') - 3);
+    expr = trim(expr);
+    size_t pos = 0;
+    int val = condexpr(expr, pos, 0, linenum);
+    if (pos < expr.length()) {
+        *errout << "Error: Unexpected '" << expr.substr(pos) << "' in condition: \"" << expr << "\" [line " << linenum << "]\n";
+        throw AsmError();
+    }
+    return val != 0;
+}
+
+// append parsed unit to program source, defining its macros and expanding includes and macro invocations
+void splice(const Unit& unit, std::vector<Line>& src, int depth) {
+    std::string line, name;
+    for (int i=0; i < (int)unit.lines.size(); i++) {
+        const Line& l = unit.lines[i];
+        line = l.text;
+        line = trim(line);
+        if (line[0] == '@') {
+            if (isdirective(line, "if")) {              // inactive - continue after matching @else/@endif
+                if (!condition(line, l.linenum)) i = unit.branches.at(i);
+                continue;
+            }
+            if (isdirective(line, "else")) {            // end of active @if region
+                i = unit.branches.at(i);
+                continue;
+            }
+            if (isdirective(line, "endif")) continue;
+            size_t eq = line.find('=');                 // record directive assignments for later conditions
+            if (eq != std::string::npos) {
+                name = line.substr(1, eq - 1);
+                std::string val = line.substr(eq + 1, line.find('#') == std::string::npos ? std::string::npos : line.find('#') - eq - 1);
+                int v = hexword(val.erase(0, val.find_first_not_of(" \t")).erase(val.find_last_not_of(" \t") + 1));
+                if (v >= 0) symbols[trim(name)] = v;
+            }
+        }
+        if (isdirective(line, "macro")) {
+            name = line.substr(7);
+            const Macro* m = &unit.macros.at(name);
+            name = name.substr(0, name.find(' '));      // key of a redefinition has its line number appended
+            if (macros.find(name) != macros.end()) {
+                *errout << "Error: Duplicate macro name: \"" << name << "\" [line " << l.linenum << "] in " << unit.path << '\n';
+                throw AsmError();
+            }
+            macros[name] = m;
+            continue;
+        }
+        if (isdirective(line, "include")) {
+            name = line.substr(8, line.find('#') == std::string::npos ? std::string::npos : line.find('#') - 8);
+            name = trim(name, "\t\n\v\f\r \"");
+            if (depth >= INCLUDE_DEPTH) {
+                *errout << "Error: Includes nested deeper than " << INCLUDE_DEPTH << ": \"" << name << "\" [line " << l.linenum << "]\n";
+                throw AsmError();
+            }
+            std::filesystem::path path(name);
+            if (path.is_relative()) path = std::filesystem::path(unit.path).parent_path() / path;       // relative to including file
+            std::shared_ptr<const Unit> inc = lex(path.string());
+            if (included.find(inc->path) != included.end()) continue;
+            included.insert(inc->path);
+            held.push_back(inc);
+            splice(*inc, src, depth+1);
+            continue;
+        }
+        addline(l.text, l.linenum, l.file, src, 0);
+    }
+}
+
+// number overlays, and redirect each JSR into an overlay from outside it to a generated resident thunk
+void overlay(std::vector<Line>& src) {
+    std::unordered_map<std::string,int> secs;       // maps labels to section
+    std::vector<std::string> called;                // overlay subroutines called from outside their overlay
+    std::string line, name, arg;
+    int sec = 0;
+
+    for (int pass=0; pass < 2; pass++) {            // find section of every label, then redirect calls
+        for (auto& l : src) {
+            line = l.text.substr(0, l.text.find('#'));
+            line = trim(line);
+            if (isdirective(line, "overlay")) {
+                name = line.substr(8);
+                name = trim(name);
+                sec = std::find(overlays.begin(), overlays.end(), name) - overlays.begin() + 1;
+                if (pass == 0 && sec <= (int)overlays.size()) {
+                    *errout << "Error: Duplicate overlay name: \"" << name << "\" [line " << l.linenum << "]\n";
+                    throw AsmError();
+                }
+                if (pass == 0) overlays.push_back(name);
+                continue;
+            }
+            if (isdirective(line, "endoverlay")) sec = 0;
+            if (line == "" || line[0] == '@') continue;
+            if (line.find(':') != std::string::npos) {
+                if (pass == 0) secs[line.substr(0, line.rfind(':'))] = sec;
+                continue;
+            }
+            if (pass == 0) continue;
+            name = line.substr(0, line.find_first_of(" \t"));
+            std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+            arg = line.substr(name.length());
+            arg = trim(arg);
+            if (jmpcodes.find(name) == jmpcodes.end() || secs.find(arg) == secs.end() || !secs[arg] || secs[arg] == sec) continue;
+            if (name != "JSR") {
+                *errout << "Error: Jump into overlay " << overlays[secs[arg]-1] << " from outside it (use JSR): \"" << l.text << "\" [line " << l.linenum << "]\n";
+                throw AsmError();
+            }
+            if (std::find(called.begin(), called.end(), arg) == called.end()) called.push_back(arg);
+            l.text = "JSR __ovl_" + arg;
+        }
+        if (sec) {
+            *errout << "Error: Unterminated overlay " << overlays[sec-1] << '\n';
+            throw AsmError();
+        }
+    }
+
+    // thunks follow the resident program
+    int reg = profile->iofirst + BANK_OFFSET;
+    std::string bank = "$" + (reg > 0xFF ? std::string(hexstr[reg >> 8], 2) : "") + std::string(hexstr[reg & 0xFF], 2);
+    for (auto& f : called) {
+        for (std::string text : {"__ovl_" + f + ":", "PSH " + bank, "MOV " + bank + ", " + std::string(hexstr[secs[f]-1], 2), "JSR " + f, "POP " + bank, std::string("RTS")})
+            src.push_back({text, 0, nullptr});
+    }
+}
+
+// value of 1 or 2 digit hex string, -1 if invalid
+int hexbyte(const std::string& str) {
+    unsigned char b;
+    if (str.length() < 1 || str.length() > 2) return -1;
+    if (str.length() == 1) return hexval[str[0]] < 16 ? hexval[str[0]] : -1;
+    return hexdecode(str.c_str(), 1, &b) ? b : -1;
+}
+
+// value of 1 to 4 digit hex string, -1 if invalid
+int hexword(const std::string& str) {
+    int v = 0;
+    if (str.length() < 1 || str.length() > 4) return -1;
+    for (char c : str) {
+        if (hexval[c] > 15) return -1;
+        v = (v << 4) | hexval[c];
+    }
+    return v;
+}
+
+// value of a data byte - hex or label (labels read as 0 on first pass). Returns -1 if invalid.
+int datavalue(const std::string& arg, bool write) {
+    if (lblmap.find(arg) != lblmap.end()) return lblmap[arg] > 0xFF ? -1 : lblmap[arg];
+    if (!write && arg.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) return 0;      // label defined later
+    return hexbyte(arg);
+}
+
+/*
+    Data Directives
+    - Decodes the bytes placed by a data directive line. On error the message is written to
+        *errout (without line number) and false is returned.
+        @byte 01, 2F, lbl       listed bytes (hex or label address)
+        @fill 10, FF            count, value
+        @data 00FF10AB...       string of hex digit pairs, whitespace ignored
+        @incbin "table.bin"     contents of binary file (path relative to code file)
+*/
+bool databytes(const std::string& line, const std::string* file, bool write, std::vector<unsigned char>& data) {
+    std::string name = line.substr(1, line.find_first_of(" \t") - 1);
+    std::string rest = line.substr(name.length()+1);
+    rest = rest.substr(0, rest.find('#'));
+    rest = trim(rest);
+    int v, n;
+
+    if (name == "byte" || name == "fill") {
+        std::vector<std::string> args = splitargs(rest);
+        if (args.empty() || (name == "fill" && args.size() != 2)) {
+            *errout << "Error: Invalid arguments for @" << name << ": \"" << line << "\"";
+            return false;
+        }
+        for (auto& arg : args) {
+            if ((v = datavalue(arg, write)) < 0) {
+                *errout << "Error: Invalid data byte \"" << arg << "\": \"" << line << "\"";
+                return false;
+            }
+            data.push_back(v);
+        }
+        if (name == "fill") {
+            n = data[0] ? data[0] : 256;                    // count of 00 fills all of memory
+            v = data[1];
+            data.assign(n, v);
+        }
+        return true;
+    }
+    if (name == "data") {
+        rest.erase(std::remove_if(rest.begin(), rest.end(), isspace), rest.end());
+        if (rest.length() % 2 != 0) {
+            *errout << "Error: @data requires hex digit pairs: \"" << line << "\"";
+            return false;
+        }
+        data.resize(rest.length() / 2);
+        if (!hexdecode(rest.data(), data.size(), data.data())) {
+            *errout << "Error: Invalid hex value in @data: \"" << line << "\"";
+            return false;
+        }
+        return true;
+    }
+
+    // incbin
+    std::filesystem::path path(trim(rest, "\t\n\v\f\r \""));
+    if (path.is_relative() && file) path = std::filesystem::path(*file).parent_path() / path;
+    std::error_code ec;
+    std::ifstream bin(path, std::ios::binary);
+    std::streamoff size = -1;
+    if (bin.is_open() && std::filesystem::is_regular_file(path, ec) && bin.seekg(0, bin.end)) size = bin.tellg();
+    if (size < 0 || !bin.seekg(0, bin.beg)) {
+        *errout << "Error opening " << path.string() << " for @incbin";
+        return false;
+    }
+    data.resize(size);
+    bin.read((char*)data.data(), data.size());
+    return true;
+}
+
+// parse code file
+void parse(std::vector<Line>& src, bool write) {
+
+    // local vars
+    std::string line;           // current line in code file being parsed
+    int linenum;
+    const std::string* file;    // code file line was read from
+    size_t eq;                  // last equals sign on line, ending the name of a directive assignment
+    int caddr = 0;              // address of current assembled instruction / operand
+    int maddr = 0;              // memory address
+    uint32_t icode;             // instruction code
+    std::string mnemonic;       // parsed mnemonic
+    std::string lbl;            // parsed label
+    int i;
+    char c; 
+    int numops;                 // number of operands in parsed instruction
+    int ops[2] = {0,0};
+    unsigned char optype[2] = {0,0};
+    std::string optext[2];      // operand text as written, for variable lookup
+    int digits[2];              // hex digits in each operand, more than 2 selects a wide operand
+    int var[2];
+    int dest;                   // label address of relative branch
+    unsigned char val;
+    unsigned char mpc;          // mpc address
+    bool sign;
+    std::vector<ScanBlock> blocks;  // character class masks of line
+    size_t end, at;             // end of code (comment start), last colon
+    std::string upper;          // line up to comment in uppercase
+    int org;                    // address set by org directive
+    int sec = 0, tsec;          // section of current instruction and of its jump target (0 resident, n overlay n-1)
+    int rescaddr = 0;           // resident address to continue from after an overlay
+
+    if (adjustBase && write) {              // adjust base by parsed offset from first pass
+        caddr += directives["base_addr"];
+        adjustBase = false;
+    }
+
+    for (auto& l : src) {
+        line = trim(l.text);
+        linenum = l.linenum;
+        file = l.file;
+
+        if (line == "") continue;       // skip blank lines
+        if (line[0] == '#') continue;   // skip past lines only containing a comment
+
+        // match assembler directive
+        if (line[0] == '@') {
+            if (isdirective(line, "byte") || isdirective(line, "fill") || isdirective(line, "data") || isdirective(line, "incbin")) {
+                std::vector<unsigned char> data;
+                if (!databytes(line, file, write, data)) {
+                    *errout << " [line " << linenum << "]\n";
+                    goto err;
+                }
+                if (caddr + (int)data.size() > profile->memsize) {
+                    *errout << "Error: Data exceeds end of memory: \"" << line << "\" [line " << linenum << "]\n";
+                    goto err;
+                }
+                if (write && !data.empty()) prog.push_back({caddr, "", 0, {0,0}, {0,0}, {-1,-1}, -1, sec, 0, 0, linenum, file, line, data});
+                caddr += data.size();
+                continue;
+            }
+            if (isdirective(line, "overlay")) {         // assemble following code at overlay window
+                lbl = line.substr(8, line.find('#') == std::string::npos ? std::string::npos : line.find('#') - 8);
+                lbl = trim(lbl);
+                if (window < 0 || sec) {
+                    *errout << "Error: " << (sec ? "Nested overlay" : "Overlay window not set (@window=XX)") << ": \"" << line << "\" [line " << linenum << "]\n";
+                    goto err;
+                }
+                sec = std::find(overlays.begin(), overlays.end(), lbl) - overlays.begin() + 1;
+                rescaddr = caddr;
+                caddr = window;
+                continue;
+            }
+            if (isdirective(line, "endoverlay")) {
+                if (!sec) {
+                    *errout << "Error: @endoverlay outside overlay [line " << linenum << "]\n";
+                    goto err;
+                }
+                sec = 0;
+                caddr = rescaddr;
+                continue;
+            }
+            eq = line.rfind('=');
+            if (eq != std::string::npos && trim(lbl = line.substr(1, eq - 1)) == "window") {
+                lbl = line.substr(eq + 1);                          // address overlays are loaded at
+                lbl = trim(lbl = lbl.substr(0, lbl.find('#')));
+                if ((window = hexword(lbl)) < 0) {
+                    *errout << "Error: Invalid hex value: \"" << lbl << "\" [line " << linenum << "]\n";
+                    goto err;
+                }
+                continue;
+            }
+            if (eq != std::string::npos && trim(lbl = line.substr(1, eq - 1)) == "org") {
+                lbl = line.substr(eq + 1);                          // start new region at address
+                lbl = trim(lbl = lbl.substr(0, lbl.find('#')));
+                if ((org = hexword(lbl)) < 0) {
+                    *errout << "Error: Invalid hex value: \"" << lbl << "\" [line " << linenum << "]\n";
+                    goto err;
+                }
+                caddr = org;
+                continue;
+            }
+            if (!write) {            // process only on first pass
+                if (eq != std::string::npos) {
+                    lbl = line.substr(1, eq - 1);                   // repurposing lbl and mnemonic strings temporarily
+                    mnemonic = line.substr(eq + 1);
+                    lbl = trim(lbl);
+                    mnemonic = trim(mnemonic);
+                    if (lbl == "var") {             // declare variable
+                        mnemonic = mnemonic.substr(0, mnemonic.find('#'));
+                        mnemonic = trim(mnemonic);
+                        if (mnemonic == "" || mnemonic.find_first_of(" ,$:") != std::string::npos) {
+                            *errout << "Error: Invalid variable name: \"" << mnemonic << "\" [line " << linenum << "]\n";
+                            goto err;
+                        }
+                        if (mnemonic.find_first_not_of("0123456789abcdefABCDEF") == std::string::npos) {
+                            *errout << "Error: Variable name must not be a valid hex value: \"" << mnemonic << "\" [line " << linenum << "]\n";
+                            goto err;
+                        }
+                        if (varmap.find(mnemonic) != varmap.end()) {
+                            *errout << "Error: Variable redeclared: \"" << mnemonic << "\" [line " << linenum << "]\n";
+                            goto err;
+                        }
+                        varmap[mnemonic] = vars.size();
+                        vars.push_back({mnemonic, -1, linenum});
+                    }
+                    else if (directives.find(lbl) != directives.end()) {
+                        mnemonic = mnemonic.substr(0, mnemonic.find('#'));
+                        mnemonic.erase(std::remove(mnemonic.begin(), mnemonic.end(), ' '), mnemonic.end());
+                        if ((org = hexword(mnemonic)) < 0 || org >= profile->memsize) {
+                            *errout << "Error: Invalid hex value: \"" << mnemonic << "\" [line " << linenum << "]\n";
+                            goto err;
+                        }
+                        directives[lbl] = org;      // store value under directive label
+                        if (lbl == "base_addr") {
+                            *msgout << "Address Offset = 0x" << std::hex << org <<'\n';
+                            caddr += org;       // adjust base address
+                            adjustBase = true;
+                        }
+                    }
+                    else {
+                        *errout << "Error: Invalid assembler directive: \"" << line << "\" [line " << linenum << "]\n";
+                        goto err;
                     }
-                    lbl += c;                   // construct label
-                    c = toupper(c);
+                }
+                else {      // all directives must match directive pattern (id=value) at the moment [if this changes, remove following error]
+                    *errout << "Error: Invalid assembler directive assignment: \"" << line << "\" [line " << linenum << "]\n";
+                    goto err;
+                }
+            }
+            continue;
+        }
+
+        // classify characters of line - comment, label colon and end of mnemonic are read from the masks
+        scan(line.data(), line.length(), blocks);
+        end = scanfirst(blocks, SCAN_HASH, 0, line.length());
+
+        // match label (anything preceding the last colon)
+        if ((at = scanlast(blocks, SCAN_COLON, 0, line.length())) < line.length()) {
+            if (!write) {
+                lbl = line.substr(0, at);
+                //if (adjustBase) {
+                //    caddr += directives["base_addr"];
+                //    adjustBase = false;
+                //}
+                //*msgout << "parsed label '" << lbl << "' to address " << std::hex << caddr << "\n";
+                lblmap[lbl] = caddr;    // cache mapped label and address pair in hash map
+                lblsec[lbl] = sec;
+            }
+            continue;
+        }
+
+        // if not label, then must be instruction
+        i = 0;
+        mnemonic = "";
+        lbl = "";
+        numops = 0;
+        ops[0] = 0;
+        ops[1] = 0;
+        optype[0] = 0;
+        optype[1] = 0;
+        optext[0] = "";
+        optext[1] = "";
+        digits[0] = 0;
+        digits[1] = 0;
+        sign = false;
+        dest = -1;
+        tsec = 0;
+        upper.resize(end);                          // code before comment, case folded once
+        foldupper(line.data(), end, &upper[0]);
+        i = scanfirst(blocks, SCAN_SPACE, 0, end);  // read mnemonic
+        mnemonic = upper.substr(0, i++);
+        //*msgout << "Mnemonic: '" << mnemonic << "'\n"; 
+        if (write) {           // handle jump/br instructions
+            if (jmpcodes.find(mnemonic) != jmpcodes.end()) {        // mnemonic is a valid jump/branch
+                numops = 1;     // all jmp/br instr. have a single immediate operand
+                optype[0] = 1;
+
+                // Since operand can be represented in code as either an immediate
+                // or a label, both are computed in parallel, then a choice is made 
+                // afterward
+                while (i < (int)end) {           // parse rest of line
+                    lbl += line[i];             // construct label
+                    c = upper[i++];
+                    if (isspace(c)) continue;   // whitespace before a comment must not shift the value
                     val = c - 48;               // compute number val from hex
                     if (c > 64) val = c - 55;
                     ops[0] <<= 4;               // calc operand value
                     ops[0] |= (val & 0x0F);
                 }
                 lbl = trim(lbl);
-                //std::cout << "Label = " << lbl << '\n';
+                //*msgout << "Label = " << lbl << '\n';
                 ops[0] += directives["base_addr"];      // adjust jump address by base address
 
                 // check if valid label otherwise might be immediate value
                 if (lblmap.find(lbl) != lblmap.end()) {
                     ops[0] = lblmap[lbl];                   // base adjusted address should be cached
+                    tsec = lblsec[lbl];
                     if (mnemonic[0] == 'B') {               // identify if relative branch instr.
                         sign = true;
-                        if (ops[0] < caddr) ops[0] = (((signed char)ops[0]) - (caddr + ALU_CARRY_ADJUST));   // back branching - must adjust for ALU carry caused by adding a 2's comp negative number (2 by default)
-                        else                ops[0] = (((signed char)ops[0]) - (caddr + 1));   // forward branching - calculate relative address as signed label addr - PC [+1 because PC will be pointing to branch argument rather than branch opcode during execution]
+                        dest = ops[0];
+                        ops[0] = encodetarget(mnemonic, caddr, ops[0]);     // offset from PC, back branches adjusted for ALU carry
+                        int off = dest - (caddr + (dest < caddr ? profile->carry : 1));
+                        if (widemode() && (off < -128 || off > 127)) {
+                            *errout << "Error: Branch target out of range (-80 to 7F): \"" << line << "\" [line " << linenum << "]\n";
+                            goto err;
+                        }
                     }
                 }
-                else if (lbl.length() > 2) {        // if not label and invalid immediate (too long)
-                    std::cerr << "Error: Operand is neither a valid label or immediate address: \"" << line << "\" [line " << linenum << "]\n";
+                else if (lbl.length() > (widemode() && mnemonic[0] != 'B' ? 4 : 2)) {      // if not label and invalid immediate (too long)
+                    *errout << "Error: Operand is neither a valid label or immediate address: \"" << line << "\" [line " << linenum << "]\n";
                     goto err;
                 }
+                ops[0] &= mnemonic[0] == 'B' ? 0xFF : addrmask();
+                if (lblmap.find(lbl) == lblmap.end() && sec && target(caddr, mnemonic, ops[0]) >= window) tsec = sec;
             }
         }
-        while (i < line.length() && !comment) {     // read operands
-            c = toupper(line[i++]);
+        while (i < (int)end) {           // read operands
+            c = upper[i++];
             if (c == ' ') continue;
-            if (c == '#') {
-                comment = true;
-                continue;
-            }
             if (c == '$') {
                 optype[numops] = 2;
                 continue;
@@ -591,75 +2002,2136 @@ void parse(std::ifstream& in, std::ofstream& out, std::string& infilename, std::
             if (c == ',') {
                 if (numops == 0) numops++;
                 else {
-                    std::cerr << "Error: Leading comma in instruction: \"" << line << "\" [line " << linenum << "]\n";
+                    *errout << "Error: Leading comma in instruction: \"" << line << "\" [line " << linenum << "]\n";
                     goto err;
                 }
                 continue;
             }
-            if ((c >= 48 && c <= 57) || (c >= 65 && c <= 70)) {     // 0-9 or A-F
-                val = c - 48;               // assume digit
-                if (c > 64) val = c - 55;   // convert if char
+            if (c == 'X' && optext[numops] == "0") digits[numops] = 0;     // '0x' prefix is not a digit
+            optext[numops] += line[i-1];
+            if ((val = hexval[c]) < 16) {   // 0-9 or A-F
                 ops[numops] <<= 4;          // calculate operand value
-                ops[numops] |= (val & 0x0F);
+                ops[numops] |= val;
+                digits[numops]++;
                 if (optype[numops] == 0) optype[numops] = 1;
             }
         }
+        for (int i=0; i < 2; i++) {         // substitute variables - address is patched in by allocvars()
+            var[i] = -1;
+            if (varmap.find(optext[i]) == varmap.end()) continue;
+            var[i] = varmap[optext[i]];
+            ops[i] = 0;
+            digits[i] = widemode() ? 4 : 2;
+            if (optype[i] == 0) optype[i] = 1;
+        }
+        if (jmpcodes.find(mnemonic) != jmpcodes.end()) {    // operand width of jump/branch does not depend on label text
+            optype[0] = 1;
+            optype[1] = 0;
+            digits[0] = widemode() && mnemonic[0] != 'B' ? 4 : 2;
+            digits[1] = 0;
+        }
+        for (int i=0; i < 2; i++) {         // select wide operand types
+            if (digits[i] > 4) {
+                *errout << "Error: Operand exceeds 2 bytes: \"" << line << "\" [line " << linenum << "]\n";
+                goto err;
+            }
+            if (digits[i] > 2) optype[i] += 2;
+        }
+        for (int i=0; i < 2; i++) {         // a number that fits in 1 byte is only wide in 16-bit mode, where a wide form is mapped
+            if (optype[i] < 3 || var[i] >= 0 || ops[i] > 0xFF || jmpcodes.find(mnemonic) != jmpcodes.end()) continue;
+            if (!widemode() || imap.find(icodeof(mnemonic, optype[0], optype[1])) == imap.end()) optype[i] -= 2;
+        }
         if (optype[1] != 0)         numops = 2;
         else if (optype[0] != 0)    numops = 1;
 
         // construct instruction code
-        icode = 0;
-        buffer = 0;
-        for (int i=0; i < mnemonic.length(); i++) {
-            if (i > 2) {
-                std::cerr << "Error: Invalid Mnemonic: \"" << mnemonic << "\" [line " << linenum << "]\n";
-                goto err;
-            }
-            buffer = mnemonic[i];           // insert mnemonic values into high order 24 bits
-            buffer <<= (8 * (3-i));
-            icode |= buffer;
+        if (mnemonic.length() > 3) {
+            *errout << "Error: Invalid Mnemonic: \"" << mnemonic << "\" [line " << linenum << "]\n";
+            goto err;
         }
-        buffer = optype[0];
-        buffer <<= 4;
-        buffer |= (optype[1] & 0x0F);
-        icode |= buffer;
+        icode = icodeof(mnemonic, optype[0], optype[1]);
 
-        //std::cout << "Instruction Code: 0x" << std::hex << icode << '\n';
+        //*msgout << "Instruction Code: 0x" << std::hex << icode << '\n';
 
         // map instruction code to MPC address
         if (imap.find(icode) == imap.end()) {
             //if (write) {
-                std::cerr << "Error: Invalid instruction: \"" << line << "\" [line " << linenum << "]. Instruction code cannot be mapped.\n";
-                std::cerr << "ICode = 0x" << std::hex << icode << '\n';
+                *errout << "Error: Invalid instruction: \"" << line << "\" [line " << linenum << "]. Instruction code cannot be mapped.\n";
+                if (optype[0] > 2 || optype[1] > 2)
+                    *errout << "Operand is 2 bytes wide but no wide form of the instruction is mapped.\n";
+                *errout << "ICode = 0x" << std::hex << icode << '\n';
                 goto err;
             //}
         }
         else {
             mpc = imap.at(icode);
-            if (write) {
-                std::cout << "0x" << std::hex << caddr << "\t0x" << std::hex << (int)mpc << "\t" << line << '\n';       // write to console
-                out.write((char*)&mpc, 1);              // write to out file
+            if (write)      // record instruction - written to out file once variables are placed
+                prog.push_back({caddr, mnemonic, numops, {ops[0], ops[1]}, {optype[0], optype[1]}, {var[0], var[1]}, dest, sec, tsec, mpc, linenum, file, line, {}});
+            caddr += 1 + width(optype[0]) + width(optype[1]);
+        }
+    }
+    return;
+
+err:
+    if (file && included.size() > 1) *errout << "In " << *file << '\n';
+    throw AsmError();
+}
+
+// absolute target address of a jump/branch instruction (undoes relative branch offset math in parse())
+int target(int addr, const std::string& mnemonic, int op) {
+    if (mnemonic[0] != 'B') return op;
+    signed char off = (signed char)op;
+    if (off < 0) return (addr + profile->carry + off) & addrmask();
+    return (addr + 1 + off) & addrmask();
+}
+
+int target(const Instr& ins) { return target(ins.addr, ins.mnemonic, ins.ops[0]); }
+
+// site of the target of a jump/branch instruction, and of the instruction following it
+int targetsite(const Instr& ins) { return site(ins.tsec, target(ins)); }
+int nextsite(const Instr& ins) { return site(ins.sec, ins.addr + length(ins)); }
+
+// name of the label at a site, or the address itself in hex if none
+std::string lblname(int at) {
+    int addr = at & 0xFFFF;
+    for (auto& l : lblmap) if (l.second == addr && lblsec[l.first] == at >> 16) return l.first;
+    std::string s = "0x";
+    if (addr > 0xFF) s.append(hexstr[addr >> 8], 2);
+    s.append(hexstr[addr & 0xFF], 2);
+    return s;
+}
+
+/*
+    Max Stack Depth of Subroutine
+    - Walks the control flow graph from the given entry address, tracking the number of
+        bytes pushed at every reachable instruction. PSH pushes 1 byte, POP pops 1 byte,
+        LSP resets the stack, and a JSR costs its 1 byte return address plus the max
+        depth of the called subroutine. RTS and HLT end a path.
+    - Where paths join at different depths the deepest is followed on. A depth that keeps
+        growing around a loop (deeper than the number of instructions, which no path without
+        a loop can reach) is unbounded.
+    - Returns -1 if the depth is unbounded (recursion, or pushing in a loop)
+*/
+int fndepth(int entry, std::unordered_map<int,int>& idx, std::unordered_map<int,int>& memo, std::set<int>& active, bool main) {
+    if (memo.find(entry) != memo.end()) return memo[entry];
+    if (active.find(entry) != active.end()) {
+        *msgout << "Warning: Unbounded recursion through subroutine " << lblname(entry) << '\n';
+        return -1;
+    }
+    active.insert(entry);
+
+    std::unordered_map<int,int> depth;          // maps instruction address to stack depth before executing it
+    std::set<int> flagged;                      // addresses already reported as unbalanced
+    std::vector<std::string> unbalanced;        // their warnings, dropped if a loop grows the stack (it explains them)
+    std::set<int> reported;                     // addresses already warned about (they may be visited at several depths)
+    std::vector<int> work;
+    std::vector<int> succ;
+    int maxd = 0, d, nd, c;
+    bool unbounded = false, grows = false;     // grows - a loop pushes more than it pops
+
+    depth[entry] = 0;
+    work.push_back(entry);
+    while (!work.empty()) {
+        int a = work.back();
+        work.pop_back();
+        bool first = reported.insert(a).second;
+        if (idx.find(a) == idx.end()) {
+            if (first) *msgout << "Warning: Control flow reaches 0x" << std::hex << (a & 0xFFFF) << " which is not an instruction\n";
+            continue;
+        }
+        const Instr& ins = prog[idx[a]];
+        int next = nextsite(ins);
+        d = depth[a];
+        nd = d;
+        succ.clear();
+
+        if (ins.mnemonic == "HLT") {}
+        else if (ins.mnemonic == "RTS") {
+            if (d != 0 && first) *msgout << "Warning: RTS with " << std::dec << d << " byte(s) still pushed [line " << ins.linenum << "]\n";
+        }
+        else if (ins.mnemonic == "JMP" || ins.mnemonic == "BR") succ.push_back(targetsite(ins));
+        else if (ins.mnemonic == "BRZ" || ins.mnemonic == "BRN") {
+            succ.push_back(targetsite(ins));
+            succ.push_back(next);
+        }
+        else if (ins.mnemonic == "JSR") {
+            c = fndepth(targetsite(ins), idx, memo, active, false);
+            if (c < 0) unbounded = true;
+            else if (d + 1 + c > maxd) maxd = d + 1 + c;
+            succ.push_back(next);
+        }
+        else {
+            if (ins.mnemonic == "PSH") nd = d + 1;
+            else if (ins.mnemonic == "LSP") nd = 0;
+            else if (ins.mnemonic == "POP") {
+                if (d == 0) {
+                    if (first) *msgout << "Warning: POP with empty stack" << (main ? "" : " pops return address") << " [line " << std::dec << ins.linenum << "]\n";
+                    nd = 0;
+                }
+                else nd = d - 1;
             }
-            caddr++;
+            succ.push_back(next);
+        }
+        if (nd > maxd) maxd = nd;
 
-            // write operands
-            for (int i=0; i < numops; i++) {
-                if (write)  {
-                    //if (optype[i] == 2) ops[i] += directives["base_addr"];      // offset given address by base address - idk what this is for anymore & probably unnecessary but leave commented out 
-                    std::cout << "0x" << std::hex << caddr << "\t0x" << std::hex << (int)ops[i] << '\n';       // write to console
-                    out.write((char*)&ops[i], 1);       // write operand
+        for (int s : succ) {
+            if (depth.find(s) == depth.end()) {
+                depth[s] = nd;
+                work.push_back(s);
+            }
+            else if (depth[s] != nd) {
+                if (flagged.insert(s).second)
+                    unbalanced.push_back("Warning: Unbalanced PSH/POP - " + lblname(s) + " reached with stack depths " + std::to_string(depth[s]) + " and " + std::to_string(nd) + '\n');
+                if (nd <= depth[s]) continue;
+                if (nd > (int)idx.size()) {         // still growing - a loop pushes more than it pops
+                    if (!grows) *msgout << "Warning: Stack grows without bound in loop through " << lblname(s) << '\n';
+                    grows = unbounded = true;
+                    continue;
                 }
-                caddr++;
+                depth[s] = nd;                      // keep deepest path
+                work.push_back(s);
             }
         }
-        linenum++;
     }
-    if (write) std::cout << '\n' << infilename << " successfully assembled to " << outfilename << " in " << std::dec << (caddr - directives["base_addr"]) << " bytes.\n";
-    return;
 
-err:
-    in.close();
-    out.close();                            // close out file
-    std::remove(outfilename.c_str());       // delete out file
-    exit(EXIT_FAILURE);
-}
\ No newline at end of file
+    if (!grows) for (auto& w : unbalanced) *msgout << w;
+    active.erase(entry);
+    memo[entry] = unbounded ? -1 : maxd;
+    return memo[entry];
+}
+
+/*
+    Static Stack Depth Analysis
+    - Computes the max stack depth for the program entry point and for every subroutine
+        (JSR target), reporting the minimal stack region the program needs
+    - If the program loads its stack pointer with an immediate (LSP X), the stack is
+        assumed to grow downward from X and the resulting region is checked against the
+        program image and the memory mapped I/O registers
+*/
+void stackcheck() {
+    std::unordered_map<int,int> idx;            // maps instruction address to index in prog
+    std::unordered_map<int,int> memo;           // maps subroutine entry to its max depth
+    std::set<int> active;                       // subroutines on the current call path
+    std::set<int> subs;                         // subroutine entry addresses
+    int top = -1;                               // stack top from LSP X
+    int entry = -1, need;
+
+    for (int i=0; i < (int)prog.size(); i++) {
+        if (!prog[i].data.empty()) continue;
+        idx[site(prog[i].sec, prog[i].addr)] = i;
+        if (entry < 0 && !prog[i].sec) entry = prog[i].addr;
+        if (prog[i].mnemonic == "JSR") subs.insert(targetsite(prog[i]));
+        if (prog[i].mnemonic == "LSP" && immediate(prog[i].optype[0])) top = prog[i].ops[0];
+    }
+    if (entry < 0) return;
+
+    *msgout << "\nStack Analysis\n--------------\n";
+    need = fndepth(entry, idx, memo, active, true);
+    for (int s : subs) fndepth(s, idx, memo, active, false);
+
+    *msgout << "Entry\t\tMax Depth\n";
+    *msgout << lblname(entry) << "\t\t";
+    if (need < 0) *msgout << "unbounded\n";
+    else *msgout << std::dec << need << " bytes\n";
+    for (int s : subs) {
+        *msgout << lblname(s) << "\t\t";
+        if (memo[s] < 0) *msgout << "unbounded\n";
+        else *msgout << std::dec << memo[s] << " bytes\n";
+    }
+
+    if (need < 0) {
+        *msgout << "Minimum stack region cannot be determined.\n";
+        return;
+    }
+    *msgout << "Minimum stack region: " << std::dec << need << " bytes";
+    if (top < 0 || need == 0) {
+        *msgout << '\n';
+        return;
+    }
+    *msgout << " [0x" << std::hex << (top - need + 1) << " - 0x" << top << "]\n";
+    stacklo = top - need + 1;
+    stackhi = top;
+    if (top - need + 1 < 0)
+        *msgout << "Warning: Stack underflows address 0x00\n";
+    for (auto& ins : prog)
+        if (top - need + 1 < ins.addr + length(ins) && top >= ins.addr) {     // any overlay may be in the window
+            *msgout << "Warning: Stack region overlaps program at 0x" << std::hex << ins.addr << " [line " << std::dec << ins.linenum << "]\n";
+            break;
+        }
+    for (auto t : targets)
+        if (top - need + 1 <= t->iolast && top >= t->iofirst) {
+            *msgout << "Warning: Stack region overlaps I/O registers [0x" << std::hex << t->iofirst << " - 0x" << t->iolast << "]";
+            if (targets.size() > 1) *msgout << " of profile " << t->name;
+            *msgout << '\n';
+        }
+}
+
+/*
+    Overlay Swap Report
+    - Follows every call path from the program entry through the call graph. A call through
+        an overlay thunk loads the overlay unless it is already in the window, and reloads
+        the caller's overlay on return if the caller was itself in an overlay.
+    - Paths are listed by the number of swaps they trigger, so that subroutines on hot
+        paths can be moved into the resident program
+*/
+#define SWAP_PATHS 1000         // max call paths followed
+
+// indices of JSR instructions reachable from subroutine entry without returning
+std::vector<int> callsfrom(int entry, std::unordered_map<int,int>& idx) {
+    std::vector<int> calls, work = {entry};
+    std::set<int> seen = {entry};
+    while (!work.empty()) {
+        int a = work.back();
+        work.pop_back();
+        if (idx.find(a) == idx.end()) continue;
+        const Instr& ins = prog[idx[a]];
+        std::vector<int> succ;
+        if (ins.mnemonic == "HLT" || ins.mnemonic == "RTS") {}
+        else if (ins.mnemonic == "JMP" || ins.mnemonic == "BR") succ.push_back(targetsite(ins));
+        else {
+            if (ins.mnemonic == "JSR") calls.push_back(idx[a]);
+            else if (jmpcodes.find(ins.mnemonic) != jmpcodes.end()) succ.push_back(targetsite(ins));
+            succ.push_back(nextsite(ins));
+        }
+        for (int s : succ) if (seen.insert(s).second) work.push_back(s);
+    }
+    return calls;
+}
+
+// follow call paths from subroutine with given overlay loaded, collecting each complete path and its swaps
+void swappaths(int fn, int bank, int swaps, const std::string& path, std::set<int>& active,
+               std::unordered_map<int,int>& idx, std::vector<std::pair<int,std::string>>& paths) {
+    std::vector<int> calls = callsfrom(fn, idx);
+    active.insert(fn);
+    if (calls.empty()) paths.push_back({swaps, path});
+    for (int c : calls) {
+        if (paths.size() >= SWAP_PATHS) break;
+        int callee = targetsite(prog[c]), into = bank, n = swaps;
+        if (lblname(callee).rfind("__ovl_", 0) == 0) {      // thunk - continue into the overlay subroutine
+            std::vector<int> inner = callsfrom(callee, idx);
+            if (inner.empty()) continue;
+            callee = targetsite(prog[inner[0]]);
+            into = prog[inner[0]].tsec - 1;
+            if (into != bank) n += bank == 0xFF ? 1 : 2;
+        }
+        if (active.find(callee) != active.end()) paths.push_back({n, path + " > " + lblname(callee) + " (recursive)"});
+        else swappaths(callee, into, n, path + " > " + lblname(callee), active, idx, paths);
+    }
+    active.erase(fn);
+}
+
+void swapreport() {
+    std::unordered_map<int,int> idx;            // maps instruction site to index in prog
+    std::vector<std::pair<int,std::string>> paths;
+    std::set<int> active;
+    int entry = -1;
+
+    if (overlays.empty()) return;
+    for (int i=0; i < (int)prog.size(); i++) {
+        if (!prog[i].data.empty()) continue;
+        idx[site(prog[i].sec, prog[i].addr)] = i;
+        if (entry < 0 && !prog[i].sec) entry = prog[i].addr;
+    }
+    if (entry < 0) return;
+    swappaths(entry, 0xFF, 0, lblname(entry), active, idx, paths);
+    std::stable_sort(paths.begin(), paths.end(), [](const std::pair<int,std::string>& a, const std::pair<int,std::string>& b) { return a.first > b.first; });
+
+    *msgout << "\nOverlay Swaps\n-------------\n";
+    for (int k=0; k < (int)overlays.size(); k++) {
+        int size = 0;
+        for (auto& r : layout(k+1)) size = std::max<int>(size, r.start + r.bytes.size() - window);
+        *msgout << "Overlay " << std::dec << k << " '" << overlays[k] << "'\t" << size << " bytes at 0x" << std::hex << window << '\n';
+    }
+    *msgout << "Swaps\tCall Path\n";
+    for (auto& p : paths) *msgout << std::dec << p.first << '\t' << p.second << '\n';
+    if (paths.size() >= SWAP_PATHS) *msgout << "(first " << std::dec << SWAP_PATHS << " call paths only)\n";
+}
+
+/*
+    Variable Allocation
+    - Computes liveness of every variable over the control flow graph of the program
+        (JSR edges lead into the subroutine, RTS edges lead back to every return point),
+        then greedily packs variables so that any two variables live at the same time
+        get different bytes while variables with disjoint lifetimes share one
+    - A variable whose address is taken (used as an immediate) is live everywhere
+    - Bytes holding the program, the stack region, the I/O registers or any address
+        referenced directly in the program are never assigned, nor are bytes beyond the
+        memory of any selected target profile
+*/
+void allocvars() {
+    std::unordered_map<int,int> idx;            // maps instruction address to index in prog
+    std::vector<int> rets;                      // return points (address following each JSR)
+    std::vector<std::set<int>> use(prog.size()), def(prog.size()), live(prog.size());
+    std::vector<std::vector<int>> succ(prog.size());
+    std::vector<std::set<int>> conflict(vars.size());
+    std::vector<bool> pinned(vars.size(), false), used(vars.size(), false);
+    int size = 0;                               // bytes of memory in largest selected profile
+    for (auto t : targets) size = std::max(size, t->memsize);
+    std::vector<bool> reserved(size, false);
+    bool changed;
+
+    int entry = -1;                             // index of first instruction
+
+    if (vars.empty()) return;
+    for (int i=0; i < (int)prog.size(); i++) {
+        if (!prog[i].data.empty()) continue;
+        idx[site(prog[i].sec, prog[i].addr)] = i;
+        if (entry < 0 && !prog[i].sec) entry = i;
+        if (prog[i].mnemonic == "JSR") rets.push_back(nextsite(prog[i]));
+    }
+
+    // collect variable uses/defs and successors of each instruction
+    for (int i=0; i < (int)prog.size(); i++) {
+        const Instr& ins = prog[i];
+        const std::string& m = ins.mnemonic;
+        int next = nextsite(ins);
+        if (!ins.data.empty()) continue;
+        for (int k=0; k < ins.numops; k++) {
+            if (direct(ins.optype[k]) && ins.var[k] < 0 && ins.ops[k] < size) reserved[ins.ops[k]] = true;
+            if (ins.var[k] < 0) continue;
+            used[ins.var[k]] = true;
+            if (immediate(ins.optype[k])) {             // address taken
+                pinned[ins.var[k]] = true;
+                continue;
+            }
+            bool writes = k == 0 && (m == "MOV" || m == "ADD" || m == "SUB" || m == "AND" || m == "OR" ||
+                                     m == "INV" || m == "NEG" || m == "SSP" || m == "POP");
+            bool reads = !(k == 0 && (m == "MOV" || m == "SSP" || m == "POP"));
+            if (writes) def[i].insert(ins.var[k]);
+            if (reads) use[i].insert(ins.var[k]);
+        }
+        if (m == "HLT") {}
+        else if (m == "RTS") succ[i] = rets;
+        else if (m == "JMP" || m == "BR") succ[i].push_back(targetsite(ins));
+        else {
+            if (jmpcodes.find(m) != jmpcodes.end()) succ[i].push_back(targetsite(ins));
+            succ[i].push_back(next);
+        }
+    }
+
+    // live-out sets - iterate backward dataflow to fixed point
+    do {
+        changed = false;
+        for (int i = prog.size()-1; i >= 0; i--) {
+            std::set<int> out;
+            for (int s : succ[i]) {
+                if (idx.find(s) == idx.end()) continue;
+                int j = idx[s];
+                for (int v : use[j]) out.insert(v);
+                for (int v : live[j]) if (def[j].find(v) == def[j].end()) out.insert(v);
+            }
+            if (out != live[i]) {
+                live[i] = out;
+                changed = true;
+            }
+        }
+    } while (changed);
+
+    // variables defined where another is live conflict, as do all variables live on entry
+    for (int i=0; i < (int)prog.size(); i++) {
+        for (int d : def[i])
+            for (int v : live[i]) if (v != d) {
+                conflict[d].insert(v);
+                conflict[v].insert(d);
+            }
+    }
+    std::set<int> initial;
+    if (entry >= 0) {
+        initial = use[entry];
+        for (int v : live[entry]) if (def[entry].find(v) == def[entry].end()) initial.insert(v);
+    }
+    for (int a : initial) for (int b : initial) if (a != b) conflict[a].insert(b);
+
+    // reserve program, stack and I/O bytes
+    for (auto& ins : prog) for (int a = ins.addr; a < ins.addr + length(ins); a++) reserved[a % size] = true;
+    for (int a = stacklo; a >= 0 && a <= stackhi && a < size; a++) reserved[a] = true;
+    for (auto t : targets) {
+        for (int a = t->iofirst; a <= t->iolast; a++) reserved[a % size] = true;
+        for (int a = t->memsize; a < size; a++) reserved[a] = true;
+    }
+
+    // greedy placement, searching upward from the end of the program
+    *msgout << "\nVariable Allocation\n-------------------\n";
+    int start = prog.empty() ? 0 : (prog.back().addr + length(prog.back())) % size;
+    for (int v=0; v < (int)vars.size(); v++) {
+        if (!used[v]) {
+            *msgout << "Warning: Variable '" << vars[v].name << "' declared but never used [line " << std::dec << vars[v].linenum << "]\n";
+            continue;
+        }
+        for (int n=0; n < size && vars[v].addr < 0; n++) {
+            int a = (start + n) % size;
+            if (reserved[a]) continue;
+            bool ok = true;
+            for (int w=0; w < v && ok; w++)
+                if (vars[w].addr == a && (pinned[v] || pinned[w] || conflict[v].find(w) != conflict[v].end())) ok = false;
+            if (ok) vars[v].addr = a;
+        }
+        if (vars[v].addr < 0) {
+            *errout << "Error: Out of memory allocating variable '" << vars[v].name << "' [line " << std::dec << vars[v].linenum << "]\n";
+            throw AsmError();
+        }
+        *msgout << vars[v].name << "\t\t0x" << std::hex << vars[v].addr << '\n';
+    }
+
+    // patch variable addresses into program
+    for (auto& ins : prog)
+        for (int k=0; k < ins.numops; k++) if (ins.var[k] >= 0) ins.ops[k] = vars[ins.var[k]].addr;
+}
+
+// write assembled program listing to console
+void listing() {
+    *msgout << "\nAddr.\tByte\tInstr.\n";
+    for (auto& ins : prog) {
+        if (!ins.data.empty()) {                    // data directive
+            for (int i=0; i < (int)ins.data.size(); i++)
+                *msgout << "0x" << std::hex << ins.addr + i << "\t0x" << std::hex << (int)ins.data[i] << (i ? "" : "\t" + ins.text) << '\n';
+            continue;
+        }
+        *msgout << "0x" << std::hex << ins.addr << "\t0x" << std::hex << (int)ins.mpc << "\t" << ins.text << '\n';
+        for (int i=0, a = ins.addr + 1; i < ins.numops; i++)
+            for (int b=0; b < width(ins.optype[i]); b++)
+                *msgout << "0x" << std::hex << a++ << "\t0x" << std::hex << ((ins.ops[i] >> (8*b)) & 0xFF) << '\n';
+    }
+}
+
+// collect section of assembled program (resident by default) into sorted list of contiguous regions, error if any bytes overlap
+std::vector<Region> layout(int sec) {
+    std::vector<Region> image;
+    std::vector<const Instr*> items;
+    for (auto& ins : prog) if (ins.sec == sec) items.push_back(&ins);
+    std::stable_sort(items.begin(), items.end(), [](const Instr* a, const Instr* b) { return a->addr < b->addr; });
+
+    for (int i=0; i < (int)items.size(); i++) {
+        const Instr& ins = *items[i];
+        if (i > 0 && ins.addr < items[i-1]->addr + length(*items[i-1])) {
+            *errout << "Error: Code at 0x" << std::hex << ins.addr << " [line " << std::dec << ins.linenum
+                      << "] overlaps code from line " << items[i-1]->linenum << '\n';
+            throw AsmError();
+        }
+        if (ins.addr + length(ins) > profile->memsize) {
+            *errout << "Error: Code exceeds end of memory [line " << std::dec << ins.linenum << "]\n";
+            throw AsmError();
+        }
+        if (image.empty() || image.back().start + (int)image.back().bytes.size() != ins.addr)
+            image.push_back({ins.addr, {}});
+        std::vector<unsigned char>& bytes = image.back().bytes;
+        if (!ins.data.empty()) bytes.insert(bytes.end(), ins.data.begin(), ins.data.end());
+        else {
+            bytes.push_back(ins.mpc);
+            for (int k=0; k < ins.numops; k++)              // wide operands low byte first
+                for (int b=0; b < width(ins.optype[k]); b++) bytes.push_back(ins.ops[k] >> (8*b));
+        }
+    }
+    return image;
+}
+
+// write memory image to out file in output format, returns number of populated bytes
+int writeimage(const std::string& name, const std::vector<Region>& image) {
+    std::string buf;
+    int size = 0;
+    for (auto& r : image) size += r.bytes.size();
+    formats.at(format).write(image, buf);
+    if (batchio) {                  // written by the batch writer, which reports failures at the end
+        batchio->write(name, std::move(buf));
+        return size;
+    }
+    std::ofstream out(name, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "Error creating " << name << ".\n";
+        return -1;
+    }
+    out.write(buf.data(), buf.size());
+    return size;
+}
+
+// raw bytes from lowest to highest populated address, gaps padded with 0x00
+void writedense(const std::vector<Region>& image, std::string& buf) {
+    if (image.empty()) return;
+    int first = image.front().start;
+    buf.assign(image.back().start + image.back().bytes.size() - first, 0x00);
+    for (auto& r : image) std::copy(r.bytes.begin(), r.bytes.end(), buf.begin() + (r.start - first));
+}
+
+// [start] [length] [bytes ...] record for each region of up to 256 bytes, start is 2 bytes (low first) in wide mode
+void writeregions(const std::vector<Region>& image, std::string& buf) {
+    for (auto& r : image) {
+        for (int i=0; i < (int)r.bytes.size(); i += 256) {
+            int n = std::min<int>(256, r.bytes.size() - i);
+            buf += (char)(r.start + i);
+            if (widemode()) buf += (char)((r.start + i) >> 8);
+            buf += (char)(n & 0xFF);
+            buf.append(r.bytes.begin() + i, r.bytes.begin() + i + n);
+        }
+    }
+}
+
+// Logisim "v2.0 raw" image from address 0x00 - runs of 3 or more equal bytes written as "count*value"
+void writelogisim(const std::vector<Region>& image, std::string& buf) {
+    std::string mem;
+    int n = 0;
+    buf = "v2.0 raw\n";
+    if (image.empty()) return;
+    writedense(image, mem);
+    mem.insert(0, image.front().start, 0x00);
+    for (int i=0, run; i < (int)mem.size(); i += run) {
+        for (run = 1; i + run < (int)mem.size() && mem[i + run] == mem[i]; run++);
+        if (run < 3) run = 1;
+        else buf += std::to_string(run) + '*';
+        buf.append(hexstr[(unsigned char)mem[i]], 2);
+        buf += ++n % 16 ? ' ' : '\n';
+    }
+    buf += '\n';
+}
+
+// Intel HEX data records of up to 16 bytes, followed by end of file record
+void writeihex(const std::vector<Region>& image, std::string& buf) {
+    unsigned char rec[20];
+    for (auto& r : image) {
+        for (int i=0; i < (int)r.bytes.size(); i += 16) {
+            int n = std::min<int>(16, r.bytes.size() - i), addr = r.start + i;
+            unsigned char sum = 0;
+            rec[0] = n;
+            rec[1] = addr >> 8;
+            rec[2] = addr & 0xFF;
+            rec[3] = 0x00;                                  // data record
+            std::copy(r.bytes.begin() + i, r.bytes.begin() + i + n, rec + 4);
+            for (int k=0; k < n + 4; k++) sum += rec[k];
+            rec[n + 4] = -sum;                              // checksum
+            buf += ':';
+            for (int k=0; k < n + 5; k++) buf.append(hexstr[rec[k]], 2);
+            buf += '\n';
+        }
+    }
+    buf += ":00000001FF\n";
+}
+
+// build reverse instruction map by decoding instruction codes in imap
+void buildrmap() {
+    for (auto& op : rmap) op.mnemonic = "";
+    for (auto& i : imap) {
+        Opcode& op = rmap[i.second];
+        if (op.mnemonic != "") continue;            // keep first mapping if several instructions share an MPC address
+        for (int k=3; k > 0; k--) if ((i.first >> (8*k)) & 0xFF) op.mnemonic += (char)((i.first >> (8*k)) & 0xFF);
+        op.optype[0] = (i.first >> 4) & 0x0F;
+        op.optype[1] = i.first & 0x0F;
+        op.numops = op.optype[1] ? 2 : op.optype[0] ? 1 : 0;
+        op.size = 1 + width(op.optype[0]) + width(op.optype[1]);
+    }
+}
+
+// encoded operand of a jump/branch at addr to target (inverse of target())
+int encodetarget(const std::string& mnemonic, int addr, int to) {
+    if (mnemonic[0] != 'B') return to;
+    if (to < addr) return (to - (addr + profile->carry)) & 0xFF;
+    return (to - (addr + 1)) & 0xFF;
+}
+
+/*
+    Disassembler
+    - Decodes a dense binary file into code that assembles back to identical bytes
+    - Bytes are decoded as instructions with the reverse instruction map, either linearly
+        from the first byte or (with -r) by following the control flow from the first byte.
+        All remaining bytes are written with '@byte'.
+    - Jump/branch targets that begin an instruction or data byte get a label 'Lxx' (xx is the
+        address), undoing the relative offset math of branches. If the label would not encode
+        back to the same byte (eg. a branch into an operand) the operand is written as is.
+    - The code file is formatted into a single buffer and written in one call
+*/
+bool disassemble(std::string& infilename, std::string& outfilename) {
+    std::ifstream in(infilename, std::ios::binary);
+    if (!in.is_open()) {
+        std::cerr << "Error opening " << infilename << ".\n";
+        return false;
+    }
+    std::vector<unsigned char> mem((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    if (dbase + (int)mem.size() > profile->memsize) {
+        std::cerr << "Error: " << infilename << " exceeds end of memory from base address 0x" << std::hex << dbase << ".\n";
+        return false;
+    }
+
+    std::string buf = "# Disassembled from " + infilename + "\n";
+    disasm(mem, dbase, buf);
+    std::ofstream out(outfilename);
+    if (!out.is_open()) {
+        std::cerr << "Error creating " << outfilename << ".\n";
+        return false;
+    }
+    out.write(buf.data(), buf.size());
+    return true;
+}
+
+// disassemble bytes starting at base address, appending code to buf
+void disasm(const std::vector<unsigned char>& mem, int dbase, std::string& buf) {
+    int end = dbase + mem.size();
+    std::vector<int> start(profile->memsize, 0);    // length of instruction starting at each address (0 if data)
+    std::vector<bool> lbl(profile->memsize, false); // address needs a label
+    auto decodable = [&](int a) {                   // instruction at address fits in binary file, in a form the assembler produces
+        const Opcode& op = rmap[mem[a - dbase]];
+        if (op.mnemonic == "" || a + op.size > end) return false;
+        if (jmpcodes.find(op.mnemonic) == jmpcodes.end()) return true;
+        return op.numops == 1 && op.optype[0] == (widemode() && op.mnemonic[0] != 'B' ? 3 : 1);
+    };
+    auto operand = [&](int a, int k) {              // value of operand k of instruction at address (wide operands low byte first)
+        const Opcode& op = rmap[mem[a - dbase]];
+        int at = a - dbase + 1 + (k ? width(op.optype[0]) : 0), v = mem[at];
+        if (width(op.optype[k]) == 2) v |= mem[at + 1] << 8;
+        return v;
+    };
+
+    // find instructions
+    if (!recursive) {
+        for (int a = dbase; a < end; a += start[a] ? start[a] : 1)
+            if (decodable(a)) start[a] = rmap[mem[a - dbase]].size;
+    }
+    else {
+        std::vector<int> work;
+        if (end > dbase) work.push_back(dbase);
+        while (!work.empty()) {
+            int a = work.back();
+            work.pop_back();
+            if (a < dbase || a >= end || start[a] || !decodable(a)) continue;
+            const Opcode& op = rmap[mem[a - dbase]];
+            bool overlaps = false;
+            for (int k=1; k < op.size; k++) overlaps |= start[a+k] != 0;
+            if (overlaps) continue;
+            start[a] = op.size;
+            if (op.mnemonic == "HLT" || op.mnemonic == "RTS") continue;
+            if (jmpcodes.find(op.mnemonic) != jmpcodes.end()) {
+                work.push_back(target(a, op.mnemonic, operand(a, 0)));
+                if (op.mnemonic == "JMP" || op.mnemonic == "BR") continue;
+            }
+            work.push_back(a + start[a]);
+        }
+    }
+
+    // label jump/branch targets where the label reproduces the operand
+    for (int a = dbase; a < end; a++) {
+        if (!start[a] || jmpcodes.find(rmap[mem[a - dbase]].mnemonic) == jmpcodes.end()) continue;
+        const std::string& mnemonic = rmap[mem[a - dbase]].mnemonic;
+        int to = target(a, mnemonic, operand(a, 0));
+        bool inside = false;                        // target is an operand byte
+        for (int k=1; k <= 4 && to - k >= dbase; k++) inside |= start[to - k] > k;
+        if (to >= dbase && to < end && !inside && encodetarget(mnemonic, a, to) == operand(a, 0)) lbl[to] = true;
+    }
+
+    // format code
+    auto hex = [](int v, int bytes) {
+        std::string s;
+        for (int b = bytes - 1; b >= 0; b--) s.append(hexstr[(v >> (8*b)) & 0xFF], 2);
+        return s;
+    };
+    int aw = widemode() ? 2 : 1;                    // bytes in an address
+    if (dbase) buf += "@base_addr=" + hex(dbase, aw) + "\n";
+    for (int a = dbase; a < end; ) {
+        if (lbl[a]) buf += "L" + hex(a, aw) + ":\n";
+        if (!start[a]) {                            // run of data bytes up to next instruction/label
+            buf += "@byte ";
+            int n = 0;
+            do {
+                buf += (n ? ", " : "") + hex(mem[a - dbase], 1);
+                a++;
+            } while (a < end && !start[a] && !lbl[a] && ++n < 8);
+            buf += '\n';
+            continue;
+        }
+        const Opcode& op = rmap[mem[a - dbase]];
+        std::string line = "    " + op.mnemonic;
+        for (int k=0; k < op.numops; k++) {
+            int v = operand(a, k), w = width(op.optype[k]);
+            line += k ? ", " : " ";
+            if (k == 0 && jmpcodes.find(op.mnemonic) != jmpcodes.end()) {
+                int to = target(a, op.mnemonic, v);
+                if (to < (int)lbl.size() && lbl[to] && encodetarget(op.mnemonic, a, to) == v) line += "L" + hex(to, aw);
+                else line += hex(v - dbase, w);     // assembler adds base address to immediate targets
+            }
+            else line += (direct(op.optype[k]) ? "$" : "") + hex(v, w);
+        }
+        line.resize(std::max<size_t>(line.length(), 24), ' ');
+        buf += line + "# " + hex(a, aw) + "\n";
+        a += start[a];
+    }
+}
+
+/*
+    Round Trip Verification
+    - Every program of the corpus (code files given plus generated programs) is assembled,
+        its image disassembled, and the disassembly assembled again. Both images must be
+        identical. Programs are checked in parallel with each thread assembling in memory.
+    - Programs that fail to assemble in the first place are skipped
+    - A mismatching program is reduced by repeatedly removing blocks of lines while the
+        mismatch remains, and the minimal reproducer is written to 'rt_fail_N.asm'
+    - Doubles as a benchmark: assembler and disassembler throughput are measured on the
+        same corpus
+*/
+struct TripStats {
+    double asmtime = 0, distime = 0;                // seconds spent assembling / disassembling
+    long asmbytes = 0, disbytes = 0;                // code bytes assembled / image bytes disassembled
+    long assemblies = 0, disassemblies = 0;
+};
+
+// round trip program, returns 0 if images match, 1 if program does not assemble, 2 if disassembly does not assemble, 3 if images differ
+int roundtrip(const std::string& text, TripStats& st) {
+    std::vector<Region> image, again;
+    std::string bytes, redone, code;
+    auto t0 = std::chrono::steady_clock::now();
+    bool ok = assembletext(text, image);
+    auto t1 = std::chrono::steady_clock::now();
+    st.asmtime += std::chrono::duration<double>(t1 - t0).count();
+    st.asmbytes += text.size();
+    st.assemblies++;
+    if (!ok || image.empty()) return 1;
+
+    writedense(image, bytes);
+    t0 = std::chrono::steady_clock::now();
+    disasm(std::vector<unsigned char>(bytes.begin(), bytes.end()), image.front().start, code);
+    t1 = std::chrono::steady_clock::now();
+    st.distime += std::chrono::duration<double>(t1 - t0).count();
+    st.disbytes += bytes.size();
+    st.disassemblies++;
+
+    t0 = std::chrono::steady_clock::now();
+    ok = assembletext(code, again);
+    t1 = std::chrono::steady_clock::now();
+    st.asmtime += std::chrono::duration<double>(t1 - t0).count();
+    st.asmbytes += code.size();
+    st.assemblies++;
+    if (!ok) return 2;
+
+    writedense(again, redone);
+    return (again.empty() || again.front().start != image.front().start || redone != bytes) ? 3 : 0;
+}
+
+// random program using every mapped instruction, with labels, branches and data
+std::string genprogram(std::mt19937& rng) {
+    std::vector<int> ops;
+    for (int i=0; i < 256; i++) if (rmap[i].mnemonic != "") ops.push_back(i);
+    if (ops.empty()) return "";
+    int n = 1 + rng() % 60, nlbl = 1 + rng() % 8, size = 0;
+    std::vector<int> at(nlbl);                      // instruction index each label is placed before
+    for (int& a : at) a = rng() % n;
+    std::string text, h = "0123456789ABCDEF";
+
+    for (int i=0; i < n && size < std::min(profile->memsize, 1024) - 6; i++) {
+        for (int l=0; l < nlbl; l++) if (at[l] == i) text += "lbl" + std::to_string(l) + ":\n";
+        if (rng() % 10 == 0) {                      // data
+            text += "@byte " + std::string(1, h[rng() % 16]) + h[rng() % 16] + "\n";
+            size++;
+            continue;
+        }
+        const Opcode& op = rmap[ops[rng() % ops.size()]];
+        text += "    " + op.mnemonic;
+        for (int k=0; k < op.numops; k++) {
+            text += k ? ", " : " ";
+            if (k == 0 && jmpcodes.find(op.mnemonic) != jmpcodes.end() && rng() % 4)
+                text += "lbl" + std::to_string(rng() % nlbl);
+            else {
+                text += direct(op.optype[k]) ? "$" : "";
+                for (int d=0; d < 2 * width(op.optype[k]); d++) text += h[rng() % 16];
+            }
+        }
+        text += rng() % 3 ? "\n" : "    # comment\n";
+        size += op.size;
+    }
+    for (int l=0; l < nlbl; l++) if (at[l] >= n) text += "lbl" + std::to_string(l) + ":\n";
+    return text;
+}
+
+// reduce mismatching program to a minimal set of lines that still mismatches
+std::string minimize(const std::string& text) {
+    std::vector<std::string> lines, trial;
+    std::string line, joined;
+    std::istringstream in(text);
+    TripStats st;
+    while (getline(in, line)) lines.push_back(line);
+    auto join = [](const std::vector<std::string>& v) {
+        std::string t;
+        for (auto& l : v) t += l + "\n";
+        return t;
+    };
+    for (size_t chunk = lines.size() / 2; chunk >= 1; chunk /= 2) {
+        for (size_t i=0; i < lines.size(); ) {
+            trial.assign(lines.begin(), lines.begin() + i);
+            trial.insert(trial.end(), lines.begin() + std::min(lines.size(), i + chunk), lines.end());
+            if (roundtrip(join(trial), st) == 3) lines = trial;
+            else i += chunk;
+        }
+    }
+    return join(lines);
+}
+
+// round trip every program of corpus in parallel, returns number of mismatches
+int verify(const std::vector<std::string>& files) {
+    std::vector<std::pair<std::string,std::string>> corpus;     // name, code
+    for (auto& f : files) {
+        std::ifstream in(f);
+        if (!in.is_open()) {
+            std::cerr << "Error opening " << f << ".\n";
+            continue;
+        }
+        corpus.push_back({f, std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>())});
+    }
+    std::mt19937 rng(92);
+    for (int i=0; i < gencount; i++) corpus.push_back({"generated #" + std::to_string(i), genprogram(rng)});
+
+    int threads = jobs ? jobs : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int> result(corpus.size());
+    std::vector<TripStats> stats(threads);
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> pool;
+    auto start = std::chrono::steady_clock::now();
+    for (int t=0; t < threads; t++) {
+        pool.emplace_back([&, t]() {
+            std::ostream quiet(nullptr);            // discard assembler messages
+            msgout = &quiet;
+            errout = &quiet;
+            for (size_t i; (i = next++) < corpus.size(); ) result[i] = roundtrip(corpus[i].second, stats[t]);
+        });
+    }
+    for (auto& t : pool) t.join();
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // report mismatches with minimized reproducers
+    int counts[4] = {0, 0, 0, 0}, nfail = 0;
+    std::ostream quiet(nullptr);
+    for (size_t i=0; i < corpus.size(); i++) {
+        counts[result[i]]++;
+        if (result[i] < 2) continue;
+        std::string repro = corpus[i].second;
+        if (result[i] == 3) {
+            msgout = &quiet;
+            errout = &quiet;
+            repro = minimize(repro);
+            msgout = &std::cout;
+            errout = &std::cerr;
+        }
+        std::string name = "rt_fail_" + std::to_string(nfail++) + ".asm";
+        std::ofstream(name) << "# Round trip " << (result[i] == 3 ? "mismatch" : "disassembly does not assemble") << ": " << corpus[i].first << '\n' << repro;
+        std::cout << (result[i] == 3 ? "Mismatch: " : "Disassembly does not assemble: ") << corpus[i].first << " -> " << name << '\n';
+    }
+
+    TripStats total;
+    for (auto& st : stats) {
+        total.asmtime += st.asmtime;
+        total.distime += st.distime;
+        total.asmbytes += st.asmbytes;
+        total.disbytes += st.disbytes;
+        total.assemblies += st.assemblies;
+        total.disassemblies += st.disassemblies;
+    }
+    std::cout << "\nRound Trip\n----------\n" << std::dec
+              << corpus.size() << " programs on " << threads << " thread(s) in " << wall << " s\n"
+              << counts[0] << " identical, " << counts[3] << " mismatched, " << counts[2] << " with invalid disassembly, "
+              << counts[1] << " skipped (do not assemble)\n"
+              << "Assembler:    " << total.assemblies << " assemblies, " << (total.asmtime > 0 ? total.assemblies / total.asmtime : 0) << " programs/s, "
+              << (total.asmtime > 0 ? total.asmbytes / total.asmtime / 1024 : 0) << " KB/s per thread\n"
+              << "Disassembler: " << total.disassemblies << " disassemblies, " << (total.distime > 0 ? total.disassemblies / total.distime : 0) << " programs/s, "
+              << (total.distime > 0 ? total.disbytes / total.distime / 1024 : 0) << " KB/s per thread\n";
+    return counts[2] + counts[3];
+}
+
+/*
+    Scanner Benchmark
+    - './asm --scanbench [MB]' generates MB megabytes (default 8) of source from random
+        programs (as in round trip verification) and reports the throughput of the line
+        scanner with each implementation the CPU supports, of case folding, and of the lexer
+        and assembler over the whole source
+    - Each measurement is the best of several runs
+*/
+int scanbench(int mb) {
+    std::mt19937 rng(1);
+    std::vector<std::string> progs;
+    std::string text;
+    while (text.length() < (size_t)mb << 20) {
+        progs.push_back(genprogram(rng));
+        if (progs.back() == "") return -1;
+        text += progs.back();
+    }
+    auto best = [](const std::function<void()>& f) {
+        double t = 1e9;
+        for (int k=0; k < 5; k++) {
+            auto start = std::chrono::steady_clock::now();
+            f();
+            t = std::min(t, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        return t;
+    };
+    double size = text.length() / 1048576.0;
+    std::vector<ScanBlock> blocks;
+    size_t lines = 0;
+    std::cout << std::fixed << std::setprecision(1) << size << " MB of generated source, " << progs.size() << " programs\n\n";
+
+    static const char* names[] = {"scalar", "SSE2", "AVX2"};
+    for (int impl = SCAN_SCALAR; impl <= scanbest(); impl++) {
+        double t = best([&]() { scan(text.data(), text.length(), blocks, (ScanImpl)impl); });
+        std::cout << std::left << std::setw(24) << "Scanner (" + std::string(names[impl]) + "):" << size / t << " MB/s\n";
+    }
+    double t = best([&]() {                 // line splitting as done by the lexer, for comparison with getline
+        lines = 0;
+        for (size_t pos = 0; pos < text.length(); pos = scanfirst(blocks, SCAN_EOL, pos, text.length()) + 1) lines++;
+    });
+    std::cout << std::setw(24) << "Line split (masks):" << size / t << " MB/s, " << lines << " lines\n";
+    t = best([&]() {
+        std::istringstream in(text);
+        std::string line;
+        while (getline(in, line)) lines++;
+    });
+    std::cout << std::setw(24) << "Line split (getline):" << size / t << " MB/s\n";
+
+    std::string folded(text.length(), '\0');
+    t = best([&]() { foldupper(text.data(), text.length(), &folded[0]); });
+    std::cout << std::setw(24) << "Case fold (bulk):" << size / t << " MB/s\n";
+    t = best([&]() { for (size_t i=0; i < text.length(); i++) folded[i] = toupper(text[i]); });
+    std::cout << std::setw(24) << "Case fold (toupper):" << size / t << " MB/s\n";
+
+    t = best([&]() {
+        Unit unit;
+        std::istringstream in(text);
+        lexstream(in, unit);
+    });
+    std::cout << std::setw(24) << "Lexer:" << size / t << " MB/s\n";
+    std::ostream quiet(nullptr);            // discard assembler messages
+    std::ostream* outs[2] = {msgout, errout};
+    msgout = errout = &quiet;
+    std::vector<Region> image;
+    t = best([&]() { for (auto& p : progs) assembletext(p, image); });
+    msgout = outs[0];
+    errout = outs[1];
+    std::cout << std::setw(24) << "Assembler:" << size / t << " MB/s (" << progs.size() / t << " programs/s)\n";
+    return 0;
+}
+
+/*
+    Performance Fuzzing
+    - './asm --perffuzz [SECONDS]' searches for code that costs the assembler time or memory
+        allocations out of proportion to its length, on THREADS threads (-j)
+    - Inputs start as generated programs and are mutated towards what the lexer and parser
+        scan: long lines, runs of ':', '=', '#', '$', ',', '@' and spaces, comment blocks and
+        repeated lines. The PERF_CORPUS inputs of highest cost per byte are mutated further.
+    - The linear cost budget (a fixed cost plus a cost per byte, in time and in allocations)
+        is fitted to generated programs at start. An input costing more than PERF_BUDGET
+        times its budget is measured again, and if still over is saved to perf_fail_N.asm.
+        Time is judged only from PERF_MIN_TIMED bytes, below which it is mostly noise.
+    - Allocations are counted per thread by replacing the global operator new, which is only
+        done in a build for fuzzing ('g++ -DPERF_ALLOCS asm92.cpp'). Other builds judge time alone.
+*/
+#define PERF_BUDGET 8               // allowed multiple of the linear cost budget
+#define PERF_MIN_TIMED 4096         // bytes of input below which time is not judged
+#define PERF_MAX_SIZE (1 << 20)     // bytes of input
+#define PERF_CORPUS 32              // inputs kept for mutation
+
+#ifdef PERF_ALLOCS
+thread_local long allocations = 0;  // operator new calls of thread
+
+// not inlined, so the compiler does not pair malloc() and free() with the new and delete expressions
+__attribute__((noinline)) void* operator new(size_t n) {
+    allocations++;
+    if (void* p = malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { free(p); }
+
+long allocated() { return allocations; }
+#else
+long allocated() { return 0; }      // not counted in this build
+#endif
+
+struct PerfCost {
+    double secs;
+    long allocs;
+    bool threw;                     // assembler threw something other than AsmError
+};
+
+// assemble code, returns cost
+PerfCost perfcost(const std::string& text) {
+    std::vector<Region> image;
+    long before = allocated();
+    bool threw = false;
+    auto start = std::chrono::steady_clock::now();
+    try {
+        assembletext(text, image);
+    }
+    catch (std::exception&) {
+        threw = true;
+    }
+    return {std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), allocated() - before, threw};
+}
+
+// mutate code towards the characters and shapes the lexer and parser scan for
+void perfmutate(std::string& text, const std::vector<std::string>& pool, std::mt19937& rng) {
+    static const char chars[] = ":=#$,@ \t\nX0";
+    size_t at = rng() % (text.length() + 1);
+    size_t len = (size_t)1 << rng() % 17;                   // 1 to 64K
+    switch (rng() % 6) {
+        case 0: text.insert(at, len, chars[rng() % (sizeof chars - 1)]); break;
+        case 1: {                                           // repeat a line
+            size_t from = text.rfind('\n', at ? at - 1 : 0);
+            from = from == std::string::npos ? 0 : from + 1;
+            size_t to = text.find('\n', from);
+            std::string line = text.substr(from, to == std::string::npos ? std::string::npos : to - from + 1);
+            if (line.empty() || line.back() != '\n') line += '\n';
+            std::string run;
+            for (size_t k=0; k < len && run.length() < PERF_MAX_SIZE; k++) run += line;
+            text.insert(from, run);
+            break;
+        }
+        case 2: {                                           // comment block
+            std::string block;
+            for (size_t k=0; k < len; k++) block += "# " + std::string(rng() % 80, 'c') + '\n';
+            text.insert(text.rfind('\n', at) == std::string::npos ? 0 : text.rfind('\n', at) + 1, block);
+            break;
+        }
+        case 3: text.erase(at, len); break;
+        case 4: {                                           // splice with another input
+            const std::string& other = pool[rng() % pool.size()];
+            size_t from = rng() % (other.length() + 1);
+            text = text.substr(0, at) + other.substr(from, len);
+            break;
+        }
+        case 5: {                                           // lengthen a line
+            size_t eol = text.find('\n', at);
+            text.insert(eol == std::string::npos ? text.length() : eol, len, chars[rng() % (sizeof chars - 1)]);
+            break;
+        }
+    }
+    if (text.length() > PERF_MAX_SIZE) text.resize(PERF_MAX_SIZE);
+}
+
+int perffuzz(int seconds) {
+    std::ostream quiet(nullptr);            // discard assembler messages
+    std::ostream* streams[2] = {msgout, errout};
+    msgout = errout = &quiet;
+
+    // fit linear cost budget to generated programs: fixed cost from an empty program, cost per byte from the rest
+    std::mt19937 rng(92);
+    std::vector<std::string> seeds;
+    for (int i=0; i < 200; i++) {
+        seeds.push_back(genprogram(rng));
+        if (seeds.back() == "") return -1;
+    }
+    double fixsecs = 1e9, bytesecs = 0, fixallocs, byteallocs = 0;
+    size_t bytes = 0;
+    for (int k=0; k < 5; k++) {
+        PerfCost c = perfcost("");
+        fixsecs = std::min(fixsecs, c.secs);
+        fixallocs = c.allocs;
+    }
+    for (int k=0; k < 3; k++) {             // best of 3 per program
+        double secs = 0, allocs = 0;
+        bytes = 0;
+        for (auto& text : seeds) {
+            PerfCost c = perfcost(text);
+            secs += std::max(0.0, c.secs - fixsecs);
+            allocs += std::max(0.0, c.allocs - fixallocs);
+            bytes += text.length();
+        }
+        if (k == 0 || secs / bytes < bytesecs) bytesecs = secs / bytes;
+        byteallocs = allocs / bytes;
+    }
+    auto over = [&](const std::string& text, const PerfCost& c) {     // multiple of budget
+        double t = text.length() >= PERF_MIN_TIMED ? c.secs / (fixsecs + bytesecs * text.length()) : 0;
+        return fixallocs > 0 ? std::max(t, c.allocs / (fixallocs + byteallocs * text.length())) : t;
+    };
+    msgout = streams[0];
+    errout = streams[1];
+    std::cout << "\nPerformance Fuzzing\n-------------------\n" << std::dec
+              << "Budget (x" << PERF_BUDGET << "): " << fixsecs * 1e6 << " us + " << bytesecs * 1e9 << " ns/byte, "
+              << fixallocs << " + " << byteallocs << " allocations/byte" << (fixallocs > 0 ? "" : " (not counted, build with -DPERF_ALLOCS)") << '\n';
+
+    std::mutex lock;                                        // guards corpus and saved
+    std::vector<std::pair<double,std::string>> corpus;      // (multiple of budget, code) of costliest inputs
+    for (auto& text : seeds) corpus.push_back({0, text});
+    int saved = 0;
+    std::atomic<bool> stop(false);
+    std::atomic<long> runs(0), total(0);
+    double worst = 0;
+
+    int threads = jobs ? jobs : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> pool;
+    auto start = std::chrono::steady_clock::now();
+    for (int t=0; t < threads; t++) {
+        pool.emplace_back([&, t]() {
+            std::ostream quiet(nullptr);
+            msgout = errout = &quiet;
+            std::mt19937 rng(92 + t);
+            std::vector<std::string> inputs;
+            std::string text;
+            while (!stop) {
+                {
+                    std::lock_guard<std::mutex> g(lock);
+                    inputs.clear();
+                    for (auto& c : corpus) inputs.push_back(c.second);
+                }
+                text = inputs[rng() % inputs.size()];
+                for (int n = 1 + rng() % 4; n > 0; n--) perfmutate(text, inputs, rng);
+                PerfCost c = perfcost(text);
+                double x = over(text, c);
+                runs++;
+                total += text.length();
+                if (x > PERF_BUDGET || c.threw) {           // measure again, keeping the best
+                    PerfCost again = perfcost(text);
+                    c.secs = std::min(c.secs, again.secs);
+                    x = over(text, c);
+                }
+
+                std::lock_guard<std::mutex> g(lock);
+                worst = std::max(worst, x);
+                if (x > PERF_BUDGET || c.threw) {
+                    std::string name = "perf_fail_" + std::to_string(saved++) + ".asm";
+                    std::ofstream out(name, std::ios::binary);
+                    out << "# " << (c.threw ? "Assembler threw an exception. " : "") << "Cost " << x << " x budget: " << text.length() << " bytes in "
+                        << c.secs * 1e6 << " us with " << c.allocs << " allocations\n" << text;
+                    std::cout << "Over budget (" << x << "x, " << text.length() << " bytes" << (c.threw ? ", threw" : "") << ") -> " << name << '\n';
+                    continue;                               // not mutated further
+                }
+                if (corpus.size() < PERF_CORPUS || x > corpus.back().first) {
+                    if (corpus.size() >= PERF_CORPUS) corpus.pop_back();
+                    corpus.insert(std::upper_bound(corpus.begin(), corpus.end(), std::make_pair(x, std::string()),
+                                                   [](auto& a, auto& b) { return a.first > b.first; }), {x, text});
+                }
+            }
+        });
+    }
+    for (int s=1; s <= seconds; s++) {
+        std::this_thread::sleep_until(start + std::chrono::seconds(s));
+        std::lock_guard<std::mutex> g(lock);
+        std::cout << std::setw(5) << s << " s: " << runs << " inputs, " << total / s / 1024 << " KB/s, costliest "
+                  << worst << "x budget, " << saved << " over budget\n";
+    }
+    stop = true;
+    for (auto& t : pool) t.join();
+    std::cout << runs << " inputs (" << total / 1024 << " KB) on " << threads << " thread(s), costliest " << worst << "x budget, "
+              << saved << " over budget (x" << PERF_BUDGET << ")\n";
+    return saved ? -1 : 0;
+}
+
+/*
+    Batch Mode
+    - Code files are read and out files written by the batch reader/writer (batchio.h), which
+        keeps many files in flight while the assembler works: io_uring on Linux, or a pool of
+        threads with blocking calls ('-i threads', and wherever io_uring is unavailable).
+        With '-i sync' each file is read and written in turn as it is assembled.
+    - './asm --iobench [N]' assembles N generated code files as a batch with each kind of
+        file I/O, and reads and writes them with no assembly, reporting files per second
+*/
+int batch(const std::vector<std::string>& files) {
+    std::unique_ptr<BatchIO> io;
+    if (iomode != IO_SYNC) io.reset(new BatchIO(files, iomode));
+    batchio = io.get();
+    std::vector<bool> failed(files.size(), false);
+    for (int i=0; i < (int)files.size(); i++) {
+        std::string infilename = files[i];
+        std::string outfilename = std::filesystem::path(infilename).replace_extension(formats.at(format).ext).string();
+        std::string text;
+        if (io && !io->read(i, text)) {
+            std::cerr << "Error opening " << infilename << ".\n";
+            failed[i] = true;
+        }
+        else if (!assemble(infilename, outfilename, io ? &text : nullptr)) {
+            std::cerr << "Failed to assemble " << infilename << ".\n";
+            failed[i] = true;
+        }
+    }
+    if (io)
+        for (const IoTask* t : io->finish()) {
+            std::cerr << "Error creating " << t->path << ".\n";
+            failed[t->tag] = true;
+        }
+    batchio = nullptr;
+    int n = std::count(failed.begin(), failed.end(), true);
+    std::cout << '\n' << std::dec << (files.size() - n) << " of " << files.size() << " files assembled.\n";
+    return n ? -1 : 0;
+}
+
+int iobench(int count) {
+    std::error_code ec;
+    std::filesystem::path dir = std::filesystem::temp_directory_path(ec) / "asm92-iobench";
+    std::filesystem::remove_all(dir, ec);
+    if (!std::filesystem::create_directories(dir, ec)) {
+        std::cerr << "Error creating " << dir.string() << ".\n";
+        return -1;
+    }
+    std::mt19937 rng(1);
+    std::vector<std::string> files, outs;
+    size_t bytes = 0;
+    for (int i=0; i < count; i++) {
+        std::string code = genprogram(rng);
+        if (code == "") return -1;
+        files.push_back((dir / ("p" + std::to_string(i) + ".asm")).string());
+        outs.push_back(std::filesystem::path(files.back()).replace_extension(formats.at(format).ext).string());
+        std::ofstream(files.back(), std::ios::binary) << code;
+        bytes += code.length();
+    }
+    bool uring = BatchIO({}, IO_URING).mode == IO_URING;
+    std::cout << count << " code files of " << bytes / count << " bytes on average in " << dir.string() << '\n';
+    std::cout << "io_uring " << (uring ? "available" : "unavailable, thread pool used in its place") << "\n\n";
+
+    const char* names[] = {"sync", "threads", "uring"};
+    auto time = [](const std::function<void()>& f) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    // read every code file and write an out file of the same size, without assembling
+    std::cout << "File I/O only:\n";
+    for (IoMode mode : {IO_SYNC, IO_THREADS_POOL, IO_URING}) {
+        double t = time([&]() {
+            BatchIO io(files, mode);
+            std::string text;
+            for (int i=0; i < count; i++) {
+                io.read(i, text);
+                if (mode == IO_SYNC) {
+                    std::ofstream(outs[i], std::ios::binary).write(text.data(), text.size());
+                }
+                else io.write(outs[i], std::move(text));
+            }
+            io.finish();
+        });
+        std::cout << std::setw(24) << names[mode] << ": " << count / t << " files/s\n";
+    }
+
+    // whole batch, with assembler output discarded
+    std::cout << "Batch assembly:\n";
+    std::ostream quiet(nullptr);
+    std::ostream* streams[2] = {msgout, errout};
+    for (IoMode mode : {IO_SYNC, IO_THREADS_POOL, IO_URING}) {
+        msgout = errout = &quiet;
+        std::streambuf* console = std::cout.rdbuf(nullptr);
+        iomode = mode;
+        int result = 0;
+        double t = time([&]() { result = batch(files); });
+        std::cout.rdbuf(console);
+        std::cout.clear();
+        msgout = streams[0];
+        errout = streams[1];
+        std::cout << std::setw(24) << names[mode] << ": " << count / t << " files/s" << (result ? " (some files failed)" : "") << '\n';
+    }
+    std::filesystem::remove_all(dir, ec);
+    return 0;
+}
+
+/*
+    Emulation
+    - Runs the assembled program on the ISA emulator (emu92.h), with each opcode bound to
+        the handler of the instruction the reverse instruction map decodes it as, and the
+        machine parameters taken from the target profile
+    - In timing mode (-c) each opcode costs the fetch plus the cycles of its microroutine:
+        the entry for its MPC address in cycles.conf, or otherwise the words up to the next
+        mapped MPC address (routines are laid out one after another in the microstore, so this
+        holds unless a routine branches in microcode or shares another's tail). The last
+        routine has no next address and falls back to the cost model.
+    - Overlays are placed in the banks of the bank-switch device, the window is empty
+        until the program loads an overlay
+*/
+// cycles of the microroutine at each mapped MPC address, and when its branch is taken
+void microcycles(int routine[256][2]) {
+    int end = -1;                                   // next mapped MPC address
+    for (int i=255; i >= 0; i--) {
+        if (rmap[i].mnemonic == "") continue;
+        auto c = mcycles.find(i);
+        if (c != mcycles.end()) std::copy(c->second.begin(), c->second.end(), routine[i]);
+        else routine[i][0] = routine[i][1] = end >= 0 ? end - i : (rmap[i].size - 1) * profile->operand;
+        end = i;
+    }
+}
+
+Machine machine(const std::vector<Region>& image) {
+    Machine m;
+    for (int i=0; i < 256; i++) m.exec[i] = emuhandler(emukind(rmap[i].mnemonic), rmap[i].optype[0], rmap[i].optype[1], timing);
+    if (timing) microcycles(m.routine);
+    m.carry = profile->carry;
+    m.iofirst = profile->iofirst;
+    m.memsize = profile->memsize;
+    m.fetch = profile->fetch;
+    m.operand = profile->operand;
+    m.wide = widemode();
+    m.mem.assign(m.memsize, 0);
+    for (auto& r : image) std::copy(r.bytes.begin(), r.bytes.end(), m.mem.begin() + r.start);
+    for (auto& ins : prog)
+        if (ins.data.empty() && !ins.sec) {         // program entry
+            m.pc = ins.addr;
+            break;
+        }
+    if (!overlays.empty()) {
+        m.window = window;
+        for (int k=0; k < (int)overlays.size(); k++) {
+            m.banks.emplace_back();
+            for (auto& r : layout(k+1)) {
+                if (m.banks[k].size() < r.start + r.bytes.size() - window) m.banks[k].resize(r.start + r.bytes.size() - window, 0);
+                std::copy(r.bytes.begin(), r.bytes.end(), m.banks[k].begin() + (r.start - window));
+            }
+        }
+    }
+    return m;
+}
+
+// assemble code file and run it with the given input bytes, returns 0 if the program halts
+int emulate(const std::string& file, const std::vector<std::string>& input) {
+    std::vector<Region> image;
+    try {
+        if (!build(*lex(file), image)) return -1;
+    }
+    catch (AsmError&) {
+        return -1;
+    }
+    Machine m = machine(image);
+    for (auto& in : input) {
+        int v = hexbyte(in);
+        if (v < 0) {
+            std::cerr << "Invalid Input. Input must be hex bytes: \"" << in << "\"\n";
+            return -1;
+        }
+        m.input.push_back(v);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    run(m);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    static const char* states[] = {"running", "halted", "faulted (invalid opcode)", "stopped (step limit)"};
+    std::cout << "\nEmulation\n---------\n" << "Program " << states[m.state] << " at 0x" << std::hex << m.pc << '\n';
+    std::cout << "Output:";
+    for (unsigned char b : m.output) std::cout << ' ' << hexstr[b][0] << hexstr[b][1];
+    std::cout << '\n' << std::dec << m.steps << " instructions, " << m.cycles << (timing ? " cycles (microcode timing)" : " cycles");
+    if (m.window >= 0) std::cout << ", " << m.swaps << " overlay swaps";
+    std::cout << " (" << (secs > 0 ? m.steps / secs / 1e6 : 0) << " M instructions/s)\n";
+    return m.state == EMU_HALTED ? 0 : -1;
+}
+
+/*
+    Input Fuzzing
+    - './asm --fuzz CODEFILE.asm [SECONDS]' searches for input bytes (read by WTI into the
+        input register) that make the program fault, run into the step limit or take the most
+        cycles, running the emulator on THREADS threads (-j, default one per core)
+    - Each run counts the edges taken by jumps, branches, calls and returns in a coverage map
+        (emu92.h). An input that hits an edge a number of times in a bucket (1, 2, 3, 4-7, 8-15,
+        16-31, 32-127, 128+) never seen for that edge joins the coverage corpus, and an input
+        taking more cycles than any before joins the cycles corpus, which keeps the slowest
+        FUZZ_SLOWEST. New inputs are mutated from entries of both, the faster of two random
+        coverage entries being taken so that slow inputs do not dominate.
+    - Inputs are kept in CODEFILE.fuzz/ (coverage/, cycles/, faults/, hangs/), one per file as
+        hex bytes to pass to --run. Inputs found by earlier runs are used as seeds.
+*/
+#define FUZZ_MAX_INPUT 256          // bytes of input per run
+#define FUZZ_STEP_LIMIT 100000      // instructions per run before the program is taken to hang
+#define FUZZ_SLOWEST 16             // inputs kept in cycles corpus
+
+// input bytes saved in file (hex bytes separated by whitespace), up to FUZZ_MAX_INPUT
+std::vector<unsigned char> readinput(const std::filesystem::path& path) {
+    std::ifstream in(path);
+    std::vector<unsigned char> bytes;
+    std::string tok;
+    while (in >> tok) {
+        int v = hexbyte(tok);
+        if (v >= 0 && bytes.size() < FUZZ_MAX_INPUT) bytes.push_back(v);
+    }
+    return bytes;
+}
+
+// apply 1 to 8 random mutations to input, splicing with other inputs of pool
+void mutate(std::vector<unsigned char>& in, const std::vector<std::vector<unsigned char>>& pool, std::mt19937& rng) {
+    static const unsigned char interesting[] = {0x00, 0x01, 0x02, 0x10, 0x20, 0x40, 0x7F, 0x80, 0x81, 0xFE, 0xFF};
+    for (int n = 1 << rng() % 4; n > 0; n--) {
+        size_t at = in.empty() ? 0 : rng() % in.size();
+        switch (rng() % 8) {
+            case 0: if (!in.empty()) in[at] ^= 1 << rng() % 8; break;
+            case 1: if (!in.empty()) in[at] = rng(); break;
+            case 2: if (!in.empty()) in[at] = interesting[rng() % sizeof interesting]; break;
+            case 3: if (!in.empty()) in[at] += (rng() % 2 ? 1 : -1) * (int)(1 + rng() % 16); break;
+            case 4: if (in.size() < FUZZ_MAX_INPUT) in.insert(in.begin() + rng() % (in.size() + 1), (unsigned char)rng()); break;
+            case 5: if (!in.empty()) in.erase(in.begin() + at); break;
+            case 6:                                                 // repeat a run of bytes
+                if (!in.empty()) {
+                    size_t len = 1 + rng() % std::min<size_t>(in.size() - at, 16);
+                    std::vector<unsigned char> run(in.begin() + at, in.begin() + at + len);
+                    in.insert(in.begin() + rng() % (in.size() + 1), run.begin(), run.end());
+                }
+                break;
+            case 7:                                                 // splice with another input
+                if (!pool.empty()) {
+                    const std::vector<unsigned char>& other = pool[rng() % pool.size()];
+                    size_t from = other.empty() ? 0 : rng() % (other.size() + 1);
+                    in.resize(std::min(in.size(), (size_t)rng() % (in.size() + 1)));
+                    in.insert(in.end(), other.begin() + from, other.end());
+                }
+                break;
+        }
+        if (in.size() > FUZZ_MAX_INPUT) in.resize(FUZZ_MAX_INPUT);
+    }
+}
+
+int fuzz(const std::string& file, int seconds) {
+    std::vector<Region> image;
+    try {
+        if (!build(*lex(file), image)) return -1;
+    }
+    catch (AsmError&) {
+        return -1;
+    }
+    Machine boot = machine(image);
+
+    // corpus directories, seeded with inputs of earlier runs (which are saved again if still of interest)
+    std::error_code ec;
+    std::filesystem::path dir = std::filesystem::path(file).replace_extension(".fuzz");
+    const char* kinds[] = {"coverage", "cycles", "faults", "hangs"};
+    std::vector<std::vector<unsigned char>> seeds = {{}, {0x00}, {0xFF}, {0x01, 0x02, 0x03, 0x04}};
+    for (const char* kind : kinds) {
+        std::filesystem::create_directories(dir / kind, ec);
+        for (auto& entry : std::filesystem::directory_iterator(dir / kind, ec)) seeds.push_back(readinput(entry.path()));
+        std::filesystem::remove_all(dir / kind, ec);
+        std::filesystem::create_directories(dir / kind, ec);
+    }
+    if (ec) {
+        std::cerr << "Error creating " << dir.string() << ".\n";
+        return -1;
+    }
+
+    // hit count buckets, as bits
+    unsigned char bucket[256] = {0};
+    for (int c=1; c < 256; c++) bucket[c] = c < 4 ? 1 << (c - 1) : c < 8 ? 0x08 : c < 16 ? 0x10 : c < 32 ? 0x20 : c < 128 ? 0x40 : 0x80;
+
+    std::mutex lock;                                        // guards everything below
+    std::vector<unsigned char> seen(EMU_EDGES, 0);          // buckets seen of each edge
+    std::vector<std::vector<unsigned char>> corpus[2];      // coverage and cycles corpora
+    std::vector<long> costs;                                // cycles taken by each coverage corpus input
+    std::atomic<long> maxcycles(-1);
+    std::set<std::pair<int,int>> bugs;                      // (state, PC) of faults and hangs found
+    int saved[4] = {0, 0, 0, 0};
+    std::atomic<int> generation(0);                         // changes whenever an input joins a corpus
+
+    auto save = [&](int kind, const std::vector<unsigned char>& in) {
+        char name[16];
+        snprintf(name, sizeof name, "%06d", saved[kind]++);
+        std::ofstream out(dir / kinds[kind] / name);
+        for (size_t i=0; i < in.size(); i++) out << (i ? " " : "") << hexstr[in[i]][0] << hexstr[in[i]][1];
+        out << '\n';
+    };
+
+    // run input, adding it to the corpora it improves, returns false if it did not
+    auto execute = [&](Machine& m, std::vector<unsigned char>& edges, std::vector<unsigned char>& known, const std::vector<unsigned char>& in) {
+        m = boot;
+        m.input = in;
+        m.edges = edges.data();
+        std::fill(edges.begin(), edges.end(), 0);
+        run(m, FUZZ_STEP_LIMIT);
+
+        bool fresh = false;
+        for (int i=0; i < EMU_EDGES; i++) if (bucket[edges[i]] & ~known[i]) fresh = true;
+        bool slow = m.cycles > maxcycles;
+        bool bug = m.state == EMU_FAULT || m.state == EMU_LIMIT;
+        if (!fresh && !slow && !bug) return false;
+
+        std::lock_guard<std::mutex> g(lock);
+        bool added = false;
+        if (fresh) {
+            bool global = false;
+            for (int i=0; i < EMU_EDGES; i++) {
+                if (bucket[edges[i]] & ~seen[i]) global = true;
+                seen[i] |= bucket[edges[i]];
+            }
+            known = seen;
+            if (global) {
+                corpus[0].push_back(in);
+                costs.push_back(m.cycles);
+                save(0, in);
+                added = true;
+            }
+        }
+        if (slow && m.cycles > maxcycles) {
+            maxcycles = m.cycles;
+            corpus[1].push_back(in);
+            if (corpus[1].size() > FUZZ_SLOWEST) corpus[1].erase(corpus[1].begin());
+            added = true;
+        }
+        if (bug && bugs.insert({m.state, m.pc}).second) {
+            int kind = m.state == EMU_FAULT ? 2 : 3;
+            save(kind, in);
+            std::cout << (kind == 2 ? "Fault" : "Hang") << " at 0x" << std::hex << m.pc << std::dec << " with input:";
+            for (unsigned char b : in) std::cout << ' ' << hexstr[b][0] << hexstr[b][1];
+            std::cout << '\n';
+        }
+        if (added) generation++;
+        return added;
+    };
+
+    std::cout << "\nFuzzing " << file << " for " << seconds << " s\n";
+    {
+        Machine m;
+        std::vector<unsigned char> edges(EMU_EDGES), known(EMU_EDGES, 0);
+        for (auto& in : seeds) execute(m, edges, known, in);
+        if (corpus[0].empty()) {
+            corpus[0].push_back({});
+            costs.push_back(0);
+        }
+    }
+
+    int threads = jobs ? jobs : std::max(1u, std::thread::hardware_concurrency());
+    std::atomic<bool> stop(false);
+    std::atomic<long> runs(0);
+    std::vector<std::thread> pool;
+    auto start = std::chrono::steady_clock::now();
+    for (int t=0; t < threads; t++) {
+        pool.emplace_back([&, t]() {
+            std::mt19937 rng(92 + t);
+            Machine m;
+            std::vector<unsigned char> edges(EMU_EDGES), known(EMU_EDGES, 0), in;
+            std::vector<std::vector<unsigned char>> both;    // copy of corpora, refreshed when they change
+            std::vector<long> cost;
+            size_t covering = 0;                            // entries of both from the coverage corpus
+            int copied = -1;
+            long done = 0;
+            while (!stop) {
+                if (copied != generation) {
+                    std::lock_guard<std::mutex> g(lock);
+                    copied = generation;
+                    both = corpus[0];
+                    covering = both.size();
+                    cost = costs;
+                    both.insert(both.end(), corpus[1].begin(), corpus[1].end());
+                    known = seen;
+                }
+                // a quarter of the time mutate one of the 4 slowest inputs (the end of the cycles corpus)
+                size_t slow = both.size() - covering, a = rng() % covering, b = rng() % covering;
+                in = both[rng() % 4 == 0 && slow ? both.size() - 1 - rng() % std::min<size_t>(slow, 4) : cost[a] < cost[b] ? a : b];
+                mutate(in, both, rng);
+                execute(m, edges, known, in);
+                if (++done % 256 == 0) runs += 256;
+            }
+            runs += done % 256;
+        });
+    }
+
+    // report progress each second
+    for (int s=1; s <= seconds; s++) {
+        std::this_thread::sleep_until(start + std::chrono::seconds(s));
+        std::lock_guard<std::mutex> g(lock);
+        int covered = std::count_if(seen.begin(), seen.end(), [](unsigned char b) { return b != 0; });
+        std::cout << std::setw(5) << s << " s: " << runs << " runs, " << covered << " edges, " << corpus[0].size() << " coverage / "
+                  << corpus[1].size() << " cycles inputs, most cycles " << maxcycles << ", " << saved[2] << " faults, " << saved[3] << " hangs\n";
+    }
+    stop = true;
+    for (auto& t : pool) t.join();
+    for (auto& in : corpus[1]) save(1, in);
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int covered = std::count_if(seen.begin(), seen.end(), [](unsigned char b) { return b != 0; });
+    std::cout << "\nFuzzing\n-------\n" << runs << " runs on " << threads << " thread(s) in " << wall << " s (" << runs / wall << " runs/s)\n"
+              << covered << " edges covered, " << corpus[0].size() << " inputs in coverage corpus, " << corpus[1].size() << " in cycles corpus\n"
+              << "Most cycles: " << maxcycles << " with input:";
+    for (unsigned char b : corpus[1].back()) std::cout << ' ' << hexstr[b][0] << hexstr[b][1];
+    std::cout << '\n' << saved[2] << " faults and " << saved[3] << " hangs (" << FUZZ_STEP_LIMIT << " instructions) found, inputs saved in " << dir.string() << '\n';
+    return saved[2] + saved[3] ? -1 : 0;
+}
+
+/*
+    Microcode Profiling
+    - './asm [-j THREADS] --microprof CODEFILE1.asm ...' runs each code file on the emulator
+        in timing mode on THREADS threads (default one per core), once with no input and once
+        with each input in its fuzz corpora (CODEFILE.fuzz/coverage and cycles) if it has them
+    - Counts the runs of each microroutine, taken and not taken, and from these the executions
+        of each microaddress, taking a routine to execute its words in order from its MPC
+        address and the opcode fetch to be the words from MPC 0
+    - Reports the routines by the cycles they take over all runs, under their mapping.conf
+        patterns, and the most executed microaddresses
+*/
+#define PROF_HOTTEST 16             // microaddresses reported
+
+// instruction pattern of opcode as written in mapping.conf (eg. "ADD A, B")
+std::string pattern(const Opcode& op) {
+    static const char* letters[2][EMU_MODES] = {{"", "X", "A", "XX", "AA"}, {"", "X", "B", "XX", "BB"}};
+    std::string text = op.mnemonic;
+    for (int k=0; k < op.numops; k++) text += std::string(k ? ", " : " ") + letters[k][op.optype[k]];
+    return text;
+}
+
+// profile microstore over code files, returns 0 if all of them assemble
+int microprofile(const std::vector<std::string>& files) {
+    timing = true;
+    int threads = jobs ? jobs : std::max(1u, std::thread::hardware_concurrency());
+    std::mutex lock;                                        // guards everything below
+    std::vector<long> hits(512, 0);                         // runs of the routine of each opcode, [2*op + taken]
+    std::vector<std::string> failed;
+    long runs = 0, steps = 0;
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> pool;
+    auto start = std::chrono::steady_clock::now();
+    for (int t=0; t < threads; t++) {
+        pool.emplace_back([&]() {
+            std::ostream quiet(nullptr);                    // discard assembler messages
+            msgout = &quiet;
+            errout = &quiet;
+            std::vector<long> counts(512, 0);
+            long n = 0, executed = 0;
+            for (size_t i; (i = next++) < files.size(); ) {
+                std::vector<Region> image;
+                bool ok;
+                try {
+                    ok = build(*lex(files[i]), image);
+                }
+                catch (AsmError&) {
+                    ok = false;
+                }
+                if (!ok) {
+                    std::lock_guard<std::mutex> g(lock);
+                    failed.push_back(files[i]);
+                    continue;
+                }
+                std::vector<std::vector<unsigned char>> inputs = {{}};
+                std::filesystem::path dir = std::filesystem::path(files[i]).replace_extension(".fuzz");
+                std::error_code ec;
+                for (const char* kind : {"coverage", "cycles"})
+                    for (auto& entry : std::filesystem::directory_iterator(dir / kind, ec)) inputs.push_back(readinput(entry.path()));
+                Machine boot = machine(image);
+                boot.hits = counts.data();
+                for (auto& in : inputs) {
+                    Machine m = boot;
+                    m.input = in;
+                    run(m);
+                    n++;
+                    executed += m.steps;
+                }
+            }
+            std::lock_guard<std::mutex> g(lock);
+            for (int k=0; k < 512; k++) hits[k] += counts[k];
+            runs += n;
+            steps += executed;
+        });
+    }
+    for (auto& t : pool) t.join();
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (auto& f : failed) std::cerr << "Failed to assemble " << f << ".\n";
+
+    // cycles of each routine, and executions of each microaddress
+    int routine[256][2];
+    microcycles(routine);
+    std::vector<long> executions(MICROSTORE_SIZE, 0);
+    std::vector<std::pair<long,int>> costs;                 // cycles, opcode (-1 for the opcode fetch)
+    long total = steps * profile->fetch;
+    for (int a=0; a < profile->fetch && a < MICROSTORE_SIZE; a++) executions[a] += steps;
+    costs.push_back({total, -1});
+    for (int op=0; op < 256; op++) {
+        if (rmap[op].mnemonic == "" || (!hits[2*op] && !hits[2*op + 1])) continue;
+        long cycles = 0;
+        for (int taken=0; taken < 2; taken++) {
+            cycles += hits[2*op + taken] * routine[op][taken];
+            for (int a = op; a < op + routine[op][taken] && a < MICROSTORE_SIZE; a++) executions[a] += hits[2*op + taken];
+        }
+        costs.push_back({cycles, op});
+        total += cycles;
+    }
+    std::stable_sort(costs.begin(), costs.end(), [](const std::pair<long,int>& a, const std::pair<long,int>& b) { return a.first > b.first; });
+    auto share = [&](long n) { return total ? 100.0 * n / total : 0.0; };
+
+    std::cout << "\nMicrocode Profile\n-----------------\n" << std::dec
+              << runs << " runs of " << files.size() - failed.size() << " program(s) on " << threads << " thread(s) in " << wall << " s: "
+              << steps << " instructions, " << total << " cycles\n\n"
+              << std::left << std::setw(16) << "Routine" << std::right << std::setw(6) << "MPC" << std::setw(14) << "Runs"
+              << std::setw(14) << "Taken" << std::setw(16) << "Cycles" << std::setw(9) << "Share" << '\n' << std::fixed << std::setprecision(2);
+    for (auto& c : costs) {
+        int op = c.second;
+        std::cout << std::left << std::setw(16) << (op < 0 ? "(fetch)" : pattern(rmap[op])) << std::right << std::setw(4) << "0x"
+                  << hexstr[op < 0 ? 0 : op][0] << hexstr[op < 0 ? 0 : op][1]
+                  << std::setw(14) << (op < 0 ? steps : hits[2*op] + hits[2*op + 1]) << std::setw(14) << (op < 0 ? 0 : hits[2*op + 1])
+                  << std::setw(16) << c.first << std::setw(8) << share(c.first) << "%\n";
+    }
+
+    std::vector<int> order(MICROSTORE_SIZE);
+    for (int a=0; a < MICROSTORE_SIZE; a++) order[a] = a;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return executions[a] > executions[b]; });
+    std::cout << "\nMost executed microaddresses:\n";
+    for (int k=0; k < PROF_HOTTEST && executions[order[k]]; k++) {
+        int a = order[k], owner = a;
+        while (owner >= 0 && rmap[owner].mnemonic == "") owner--;
+        std::cout << "  0x" << hexstr[a][0] << hexstr[a][1] << std::setw(16) << executions[a] << std::setw(8) << share(executions[a]) << "%   "
+                  << (a < profile->fetch || owner < 0 ? "(fetch)" : pattern(rmap[owner])) << '\n';
+    }
+    std::cout << std::defaultfloat;
+    return failed.empty() ? 0 : -1;
+}
+
+/*
+    Language Server
+    - './asm --lsp' serves the Language Server Protocol (JSON-RPC over stdio) to editors
+    - Each open document is held as a parsed unit whose lines are edited in place by
+        incremental changes, so only changed lines are re-lexed. A document without macros
+        or conditionals is assembled straight from those lines (macro bodies and @if
+        regions are matched up over the whole file, so such a document is re-lexed in full).
+    - A symbol index maps every label and variable to the lines that define and reference
+        it, updated line by line, for go-to-definition and find-references
+    - Changes are assembled once the editor stops sending them (no input waiting), then
+        errors and warnings are published as diagnostics. The address, bytes and cycles
+        (cost model of the target profile) of each line are given as inlay hints and on hover.
+*/
+struct LineSyms {
+    std::string def;                                    // label or variable defined on line
+    int defcol = 0;
+    std::vector<std::pair<std::string,int>> refs;       // names referenced on line, and their columns
+    bool whole = false;                                 // line is @macro/@endm or a conditional (lexed with the whole file)
+};
+struct LineCost {
+    int addr = -1;                                      // address of first byte (-1 if none)
+    int bytes = 0, cycles = 0;
+};
+struct Document {
+    Unit unit;                                          // document lines (path is the file of the uri)
+    std::vector<LineSyms> syms;                         // symbols of each line
+    std::unordered_map<std::string,std::set<int>> defs, refs;      // symbol index - maps names to lines
+    int wholelines = 0;                                 // lines defining macros or conditionals
+    bool dirty = true;                                  // changed since last assembled
+    std::vector<LineCost> costs;                        // of each line, from last assembly
+    std::unordered_map<std::string,int> labels;         // label addresses, from last assembly
+};
+std::map<std::string,Document> documents;               // open documents by uri
+
+// symbols defined and referenced on line of code
+LineSyms lspsyms(const std::string& text) {
+    LineSyms s;
+    std::string code = text.substr(0, text.find('#')), line = code;
+    line = trim(line);
+    size_t start = text.find_first_not_of(" \t");
+    if (line == "") return s;
+    s.whole = isdirective(line, "macro") || isdirective(line, "endm") || isdirective(line, "if") || isdirective(line, "else") || isdirective(line, "endif");
+    size_t from = 0;
+    bool jump = false;
+    if (line[0] == '@') {
+        size_t eq = code.find('=');
+        std::string name = eq == std::string::npos ? "" : code.substr(start + 1, eq - start - 1);
+        if (isdirective(line, "var") || trim(name) == "var") {
+            s.def = code.substr(eq == std::string::npos ? start + 4 : eq + 1);
+            s.def = trim(s.def);
+            s.defcol = code.find(s.def, eq == std::string::npos ? start + 4 : eq + 1);
+            return s;
+        }
+        if (!isdirective(line, "byte")) return s;
+        from = start + 5;
+    }
+    else if (code.rfind(':') != std::string::npos) {        // label (as matched by parse())
+        s.def = code.substr(0, code.rfind(':'));
+        s.def = trim(s.def);
+        s.defcol = start;
+        return s;
+    }
+    else {
+        from = code.find_first_of(" \t", start);
+        std::string mnemonic = code.substr(start, from - start);
+        std::transform(mnemonic.begin(), mnemonic.end(), mnemonic.begin(), ::toupper);
+        jump = jmpcodes.find(mnemonic) != jmpcodes.end();
+        if (from == std::string::npos) return s;
+    }
+    for (size_t i = from; i < code.length(); ) {            // operand words that are not numbers
+        if (!isalnum((unsigned char)code[i]) && code[i] != '_' && code[i] != '.') {
+            i++;
+            continue;
+        }
+        size_t j = i;
+        while (j < code.length() && (isalnum((unsigned char)code[j]) || code[j] == '_' || code[j] == '.')) j++;
+        std::string word = code.substr(i, j - i);
+        bool number = word.find_first_not_of("0123456789abcdefABCDEF", word.compare(0, 2, "0x") && word.compare(0, 2, "0X") ? 0 : 2) == std::string::npos;
+        if (!number || jump) s.refs.push_back({word, (int)i});
+        i = j;
+    }
+    return s;
+}
+
+// replace lines [first, last] of document with text, re-lexing and re-indexing only those lines
+void lspedit(Document& doc, int first, int last, const std::string& text) {
+    std::vector<Line>& lines = doc.unit.lines;
+    std::vector<std::string> added;
+    std::stringstream in(text);
+    std::string l;
+    while (getline(in, l)) {
+        if (!l.empty() && l.back() == '\r') l.pop_back();
+        added.push_back(l);
+    }
+    if (text.empty() || text.back() == '\n') added.push_back("");
+
+    for (int i = first; i <= last; i++) {                   // drop old lines from index
+        LineSyms& s = doc.syms[i];
+        if (s.def != "") doc.defs[s.def].erase(i);
+        for (auto& r : s.refs) doc.refs[r.first].erase(i);
+        doc.wholelines -= s.whole;
+    }
+    int delta = added.size() - (last - first + 1);
+    if (delta) {                                            // renumber index past the edit
+        for (auto* index : {&doc.defs, &doc.refs})
+            for (auto& e : *index) {
+                std::set<int> shifted;
+                for (int n : e.second) shifted.insert(n > last ? n + delta : n);
+                e.second.swap(shifted);
+            }
+    }
+    lines.erase(lines.begin() + first, lines.begin() + last + 1);
+    doc.syms.erase(doc.syms.begin() + first, doc.syms.begin() + last + 1);
+    std::vector<Line> newlines;
+    std::vector<LineSyms> newsyms;
+    for (int k=0; k < (int)added.size(); k++) {
+        newlines.push_back({added[k], first + k + 1, &doc.unit.path});
+        newsyms.push_back(lspsyms(added[k]));
+        LineSyms& s = newsyms.back();
+        if (s.def != "") doc.defs[s.def].insert(first + k);
+        for (auto& r : s.refs) doc.refs[r.first].insert(first + k);
+        doc.wholelines += s.whole;
+    }
+    lines.insert(lines.begin() + first, newlines.begin(), newlines.end());
+    doc.syms.insert(doc.syms.begin() + first, newsyms.begin(), newsyms.end());
+    if (delta)
+        for (int i = first + added.size(); i < (int)lines.size(); i++) lines[i].linenum = i + 1;
+    doc.dirty = true;
+}
+
+// uri of document to file path
+std::string lsppath(const std::string& uri) {
+    std::string path;
+    size_t i = uri.compare(0, 7, "file://") ? 0 : 7;
+    for (; i < uri.length(); i++) {
+        if (uri[i] == '%' && i + 2 < uri.length() && hexval[uri[i+1]] < 16 && hexval[uri[i+2]] < 16) {
+            path += (char)(hexval[uri[i+1]] << 4 | hexval[uri[i+2]]);
+            i += 2;
+        }
+        else path += uri[i];
+    }
+    return path;
+}
+
+Json lsprange(int line, int from, int to) {
+    Json r;
+    r["start"]["line"] = line;
+    r["start"]["character"] = from;
+    r["end"]["line"] = line;
+    r["end"]["character"] = to;
+    return r;
+}
+
+// assemble document, returns diagnostics for its errors and warnings
+Json lspbuild(Document& doc) {
+    std::ostringstream msgs, errs;
+    std::vector<Region> image;
+    std::ostream* outs[2] = {msgout, errout};
+    msgout = &msgs;
+    errout = &errs;
+    if (doc.wholelines) {           // macro bodies and conditionals must be matched up by the lexer
+        Unit unit;
+        std::string text;
+        for (auto& l : doc.unit.lines) text += l.text + '\n';
+        std::istringstream in(text);
+        unit.path = doc.unit.path;
+        try {
+            lexstream(in, unit);
+            for (auto& l : unit.lines) l.file = &doc.unit.path;
+            build(unit, image);
+        }
+        catch (AsmError&) {}
+    }
+    else build(doc.unit, image);
+    msgout = outs[0];
+    errout = outs[1];
+
+    doc.costs.assign(doc.unit.lines.size(), LineCost());
+    for (auto& ins : prog) {
+        if (!ins.file || *ins.file != doc.unit.path || ins.linenum < 1 || ins.linenum > (int)doc.costs.size()) continue;
+        LineCost& c = doc.costs[ins.linenum - 1];
+        if (c.addr < 0) c.addr = ins.addr;
+        c.bytes += length(ins);
+        if (ins.data.empty()) c.cycles += profile->fetch + (length(ins) - 1) * profile->operand;
+    }
+    doc.labels = lblmap;
+    doc.dirty = false;
+
+    // one diagnostic per message, placed on the line it names (continuation lines are appended)
+    Json diags = Json::array();
+    std::string text;
+    for (int severity : {1, 2}) {
+        std::istringstream in(severity == 1 ? errs.str() : msgs.str());
+        while (getline(in, text)) {
+            bool start = text.compare(0, severity == 1 ? 5 : 7, severity == 1 ? "Error" : "Warning") == 0;
+            if (!start) {
+                if (severity == 1 && !diags.arr.empty()) diags.arr.back()["message"].str += '\n' + text;
+                continue;
+            }
+            int line = 0;
+            size_t at = text.rfind("[line ");
+            if (at != std::string::npos) line = std::max(0, atoi(text.c_str() + at + 6) - 1);
+            Json d;
+            d["range"] = lsprange(line, 0, line < (int)doc.unit.lines.size() ? doc.unit.lines[line].text.length() : 0);
+            d["severity"] = severity;
+            d["source"] = "asm92";
+            d["message"] = text;
+            diags.push(d);
+        }
+    }
+    return diags;
+}
+
+// write JSON-RPC message to stdout
+void lspsend(const Json& msg) {
+    std::string body = jsondump(msg);
+    std::cout << "Content-Length: " << body.length() << "\r\n\r\n" << body;
+    std::cout.flush();
+}
+
+void lspreply(const Json& id, const Json& result) {
+    Json msg;
+    msg["jsonrpc"] = "2.0";
+    msg["id"] = id;
+    msg["result"] = result;
+    lspsend(msg);
+}
+
+void lsppublish(const std::string& uri, const Json& diags) {
+    Json msg;
+    msg["jsonrpc"] = "2.0";
+    msg["method"] = "textDocument/publishDiagnostics";
+    msg["params"]["uri"] = uri;
+    msg["params"]["diagnostics"] = diags;
+    lspsend(msg);
+}
+
+// word (label or variable name) at position in line
+std::string lspword(const Document& doc, int line, int col) {
+    if (line < 0 || line >= (int)doc.unit.lines.size()) return "";
+    const std::string& text = doc.unit.lines[line].text;
+    auto isword = [&](int i) { return i >= 0 && i < (int)text.length() && (isalnum((unsigned char)text[i]) || text[i] == '_' || text[i] == '.'); };
+    int from = std::min(std::max(col, 0), (int)text.length()), to = from;
+    while (isword(from - 1)) from--;
+    while (isword(to)) to++;
+    return text.substr(from, to - from);
+}
+
+// serve language server protocol on stdin/stdout until exit notification
+int lspserve() {
+    std::ios::sync_with_stdio(false);
+    bool shutdown = false;
+    std::string header, body;
+    while (true) {
+        // assemble changed documents once no more changes are waiting
+        if (std::cin.rdbuf()->in_avail() <= 0)
+            for (auto& d : documents)
+                if (d.second.dirty) lsppublish(d.first, lspbuild(d.second));
+
+        size_t len = 0;
+        while (getline(std::cin, header) && header != "\r" && header != "")
+            if (header.compare(0, 15, "Content-Length:") == 0) len = atol(header.c_str() + 15);
+        if (!std::cin) return shutdown ? 0 : 1;
+        body.resize(len);
+        std::cin.read(&body[0], len);
+
+        Json msg = jsonparse(body);
+        const std::string& method = msg["method"].str;
+        const Json& params = msg["params"];
+        const std::string& uri = params["textDocument"]["uri"].str;
+        auto doc = documents.find(uri);
+        int line = params["position"]["line"].integer();
+        int col = params["position"]["character"].integer();
+
+        if (method == "initialize") {
+            Json caps;
+            caps["textDocumentSync"]["openClose"] = true;
+            caps["textDocumentSync"]["change"] = 2;                 // incremental
+            caps["definitionProvider"] = true;
+            caps["referencesProvider"] = true;
+            caps["hoverProvider"] = true;
+            caps["inlayHintProvider"] = true;
+            Json result;
+            result["capabilities"] = caps;
+            result["serverInfo"]["name"] = "asm92";
+            lspreply(msg["id"], result);
+        }
+        else if (method == "shutdown") {
+            shutdown = true;
+            lspreply(msg["id"], Json());
+        }
+        else if (method == "exit") return shutdown ? 0 : 1;
+        else if (method == "textDocument/didOpen") {
+            Document& d = documents[uri];
+            d = Document();
+            d.unit.path = lsppath(uri);
+            d.syms.resize(1);
+            d.unit.lines.push_back({"", 1, &d.unit.path});
+            lspedit(d, 0, 0, params["textDocument"]["text"].str);
+        }
+        else if (method == "textDocument/didChange" && doc != documents.end()) {
+            for (auto& c : params["contentChanges"].arr) {
+                Document& d = doc->second;
+                int first = 0, last = d.unit.lines.size() - 1;
+                std::string text = c["text"].str;
+                if (c.has("range")) {           // splice change into the lines it spans
+                    first = std::min(c["range"]["start"]["line"].integer(), last);
+                    int endline = std::min(c["range"]["end"]["line"].integer(), last);
+                    std::string head = d.unit.lines[first].text, tail = d.unit.lines[endline].text;
+                    head = head.substr(0, std::min((size_t)c["range"]["start"]["character"].integer(), head.length()));
+                    tail = tail.substr(std::min((size_t)c["range"]["end"]["character"].integer(), tail.length()));
+                    text = head + text + tail;
+                    last = endline;
+                }
+                lspedit(d, first, last, text);
+            }
+        }
+        else if (method == "textDocument/didClose") {
+            if (doc != documents.end()) documents.erase(doc);
+            lsppublish(uri, Json::array());
+        }
+        else if (method == "textDocument/definition" || method == "textDocument/references") {
+            Json locs = Json::array();
+            if (doc != documents.end()) {
+                Document& d = doc->second;
+                std::string word = lspword(d, line, col);
+                bool refs = method == "textDocument/references";
+                auto add = [&](int n, int at) {
+                    Json loc;
+                    loc["uri"] = uri;
+                    loc["range"] = lsprange(n, at, at + word.length());
+                    locs.push(loc);
+                };
+                if (!refs || params["context"]["includeDeclaration"].b)
+                    for (int n : d.defs[word]) add(n, d.syms[n].defcol);
+                if (refs)
+                    for (int n : d.refs[word])
+                        for (auto& r : d.syms[n].refs) if (r.first == word) add(n, r.second);
+            }
+            lspreply(msg["id"], locs);
+        }
+        else if (method == "textDocument/hover" || method == "textDocument/inlayHint") {
+            Json result = method == "textDocument/hover" ? Json() : Json::array();
+            if (doc != documents.end()) {
+                Document& d = doc->second;
+                if (d.dirty) lsppublish(uri, lspbuild(d));
+                std::stringstream text;
+                if (method == "textDocument/hover") {
+                    std::string word = lspword(d, line, col);
+                    if (d.labels.find(word) != d.labels.end())
+                        text << word << " = 0x" << std::hex << d.labels[word] << '\n';
+                    if (line >= 0 && line < (int)d.costs.size() && d.costs[line].addr >= 0)
+                        text << "0x" << std::hex << d.costs[line].addr << ": " << std::dec << d.costs[line].bytes
+                             << " byte(s), " << d.costs[line].cycles << " cycle(s)";
+                    if (text.str() != "") result["contents"] = text.str();
+                }
+                else {
+                    int from = std::max(0, params["range"]["start"]["line"].integer());
+                    int to = std::min((int)d.costs.size() - 1, params["range"]["end"]["line"].integer());
+                    for (int n = from; n <= to; n++) {
+                        if (d.costs[n].addr < 0) continue;
+                        text.str("");
+                        text << "0x" << std::hex << d.costs[n].addr << std::dec << "  " << d.costs[n].bytes << "B";
+                        if (d.costs[n].cycles) text << " " << d.costs[n].cycles << "c";
+                        Json hint;
+                        hint["position"]["line"] = n;
+                        hint["position"]["character"] = (int)d.unit.lines[n].text.length();
+                        hint["label"] = text.str();
+                        hint["paddingLeft"] = true;
+                        result.push(hint);
+                    }
+                }
+            }
+            lspreply(msg["id"], result);
+        }
+        else if (msg.has("id") && method != "") {
+            Json err;
+            err["jsonrpc"] = "2.0";
+            err["id"] = msg["id"];
+            err["error"]["code"] = -32601;
+            err["error"]["message"] = "Method not found: " + method;
+            lspsend(err);
+        }
+    }
+}
@@ -0,0 +1,415 @@
+#ifndef BATCHIO_H
+#define BATCHIO_H
+
+/*
+    Batch I/O
+    - Reads the code files of a batch and writes the images assembled from them with many
+        operations in flight, so opening, reading, writing and closing each small file
+        overlaps the assembly of others instead of taking turns with it
+    - On Linux the operations are submitted to an io_uring with raw system calls. Each slot
+        of the ring owns a buffer registered with the kernel once, and files are read and
+        written through it IO_BUFFER bytes at a time (unregistered if the memory lock limit
+        is too low)
+    - Without io_uring (other systems, older kernels, or disabled) a pool of threads
+        performs the same operations with blocking calls
+    - Code files are read at most IO_DEPTH files ahead of the assembler, so memory stays
+        bounded however long the batch is
+*/
+
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define IO_DEPTH 64             // operations in flight (ring slots, or reads ahead of the thread pool)
+#define IO_BUFFER 65536         // bytes per registered buffer
+#define IO_THREADS 16           // threads of fallback pool
+
+enum IoMode { IO_SYNC, IO_THREADS_POOL, IO_URING };
+
+struct IoTask {
+    std::string path;
+    std::string data;           // contents read, or to write
+    bool write = false;
+    int tag = -1;               // input being assembled when a write was queued
+    int err = 0;                // errno of failed operation
+    bool done = false;
+};
+
+// blocking read or write of a whole file
+inline void ioblocking(IoTask& t) {
+    FILE* f = fopen(t.path.c_str(), t.write ? "wb" : "rb");
+    if (!f) {
+        t.err = errno ? errno : EIO;
+        return;
+    }
+    if (t.write) {
+        if (fwrite(t.data.data(), 1, t.data.size(), f) != t.data.size()) t.err = errno ? errno : EIO;
+    }
+    else {
+        char buf[IO_BUFFER];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof buf, f)) > 0) t.data.append(buf, n);
+        if (ferror(f)) t.err = EIO;
+    }
+    if (fclose(f) != 0 && !t.err) t.err = errno ? errno : EIO;
+}
+
+struct BatchIO {
+    IoMode mode;
+    std::vector<IoTask> reads;          // one per input, in order
+    std::deque<IoTask> writes;
+    size_t consumed = 0;                // inputs handed to the assembler
+    size_t nextread = 0;                // next input to start reading
+    size_t nextwrite = 0;               // next queued write to start
+    size_t writesdone = 0;
+
+    // thread pool
+    std::vector<std::thread> pool;
+    std::mutex lock;
+    std::condition_variable changed;
+    bool stopping = false;
+
+#ifdef __linux__
+    // io_uring - one operation in flight per slot, moving from open to transfers to close
+    enum Stage { IO_OPEN, IO_XFER, IO_CLOSE };
+    struct Slot {
+        IoTask* task = nullptr;
+        Stage stage;
+        int fd;
+        size_t off;
+    };
+    int ring = -1;
+    void *sqmap = MAP_FAILED, *cqmap = MAP_FAILED, *sqemap = MAP_FAILED;
+    size_t sqlen = 0, cqlen = 0, sqelen = 0;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray, *cqhead, *cqtail, *cqmask;
+    io_uring_sqe* sqes;
+    io_uring_cqe* cqes;
+    unsigned queued = 0;                // operations prepared since last submission
+    bool fixed = false;                 // buffers registered
+    std::vector<char> buffers;
+    Slot slots[IO_DEPTH];
+#endif
+
+    BatchIO(const std::vector<std::string>& inputs, IoMode m) : mode(m) {
+        for (auto& p : inputs) {
+            reads.emplace_back();
+            reads.back().path = p;
+        }
+#ifdef __linux__
+        if (mode == IO_URING && !ringsetup()) mode = IO_THREADS_POOL;
+#else
+        if (mode == IO_URING) mode = IO_THREADS_POOL;
+#endif
+        if (mode == IO_THREADS_POOL)
+            for (int i=0; i < IO_THREADS; i++) pool.emplace_back([this]() { worker(); });
+    }
+
+    ~BatchIO() {
+        finish();
+        {
+            std::lock_guard<std::mutex> g(lock);
+            stopping = true;
+        }
+        changed.notify_all();
+        for (auto& t : pool) t.join();
+#ifdef __linux__
+        if (sqemap != MAP_FAILED) munmap(sqemap, sqelen);
+        if (cqmap != MAP_FAILED && cqmap != sqmap) munmap(cqmap, cqlen);
+        if (sqmap != MAP_FAILED) munmap(sqmap, sqlen);
+        if (ring >= 0) close(ring);
+#endif
+    }
+
+    // contents of input i (inputs are taken in order), false if it could not be read
+    bool read(size_t i, std::string& text) {
+        IoTask& t = reads[i];
+        if (mode == IO_THREADS_POOL) {
+            std::unique_lock<std::mutex> g(lock);
+            consumed = i + 1;
+            changed.notify_all();
+            changed.wait(g, [&]() { return t.done; });
+        }
+        else {
+            consumed = i + 1;
+#ifdef __linux__
+            while (mode == IO_URING && !t.done) pump(true);
+#endif
+            if (!t.done) {
+                ioblocking(t);
+                t.done = true;
+            }
+        }
+        text = std::move(t.data);
+        t.data = std::string();
+        return !t.err;
+    }
+
+    // queue data to be written to path
+    void write(const std::string& path, std::string data) {
+        IoTask* t;
+        {
+            std::lock_guard<std::mutex> g(lock);
+            writes.emplace_back();
+            t = &writes.back();
+            t->path = path;
+            t->data = std::move(data);
+            t->write = true;
+            t->tag = (int)consumed - 1;
+        }
+        if (mode == IO_SYNC) {
+            ioblocking(*t);
+            t->done = true;
+            nextwrite++;
+            writesdone++;
+        }
+        else if (mode == IO_THREADS_POOL) changed.notify_all();
+#ifdef __linux__
+        else pump(false);
+#endif
+    }
+
+    // wait for queued writes, returns those that failed
+    std::vector<const IoTask*> finish() {
+        if (mode == IO_THREADS_POOL) {
+            std::unique_lock<std::mutex> g(lock);
+            changed.wait(g, [&]() { return writesdone == writes.size(); });
+        }
+#ifdef __linux__
+        else if (mode == IO_URING)
+            while (writesdone < writes.size() || busy()) pump(true);
+#endif
+        std::vector<const IoTask*> failed;
+        for (auto& t : writes) if (t.err) failed.push_back(&t);
+        return failed;
+    }
+
+private:
+    // next operation to start - writes first, then reads within the read-ahead window
+    IoTask* take() {
+        if (nextwrite < writes.size()) return &writes[nextwrite++];
+        if (nextread < reads.size() && nextread < consumed + IO_DEPTH) return &reads[nextread++];
+        return nullptr;
+    }
+
+    void worker() {
+        std::unique_lock<std::mutex> g(lock);
+        while (true) {
+            IoTask* t;
+            changed.wait(g, [&]() { return stopping || (t = take()); });
+            if (stopping) return;
+            g.unlock();
+            ioblocking(*t);
+            g.lock();
+            t->done = true;
+            if (t->write) writesdone++;
+            changed.notify_all();
+        }
+    }
+
+#ifdef __linux__
+    // set up ring and register buffers, false if io_uring or an operation it needs is unavailable
+    bool ringsetup() {
+        io_uring_params p;
+        memset(&p, 0, sizeof p);
+        ring = syscall(__NR_io_uring_setup, IO_DEPTH, &p);
+        if (ring < 0) return false;
+
+        // operations used need kernel 5.6
+        std::vector<char> probebuf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+        io_uring_probe* probe = (io_uring_probe*)probebuf.data();
+        if (syscall(__NR_io_uring_register, ring, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+        for (int op : {IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_READ, IORING_OP_WRITE})
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+
+        sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqlen = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) sqlen = cqlen = std::max(sqlen, cqlen);
+        sqmap = mmap(nullptr, sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+        if (sqmap == MAP_FAILED) return false;
+        cqmap = p.features & IORING_FEAT_SINGLE_MMAP ? sqmap :
+                mmap(nullptr, cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+        if (cqmap == MAP_FAILED) return false;
+        sqelen = p.sq_entries * sizeof(io_uring_sqe);
+        sqemap = mmap(nullptr, sqelen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+        if (sqemap == MAP_FAILED) return false;
+
+        char* sq = (char*)sqmap;
+        char* cq = (char*)cqmap;
+        sqhead = (unsigned*)(sq + p.sq_off.head);
+        sqtail = (unsigned*)(sq + p.sq_off.tail);
+        sqmask = (unsigned*)(sq + p.sq_off.ring_mask);
+        sqarray = (unsigned*)(sq + p.sq_off.array);
+        cqhead = (unsigned*)(cq + p.cq_off.head);
+        cqtail = (unsigned*)(cq + p.cq_off.tail);
+        cqmask = (unsigned*)(cq + p.cq_off.ring_mask);
+        sqes = (io_uring_sqe*)sqemap;
+        cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+        buffers.resize((size_t)IO_DEPTH * IO_BUFFER);
+        iovec iov[IO_DEPTH];
+        for (int i=0; i < IO_DEPTH; i++) iov[i] = {buffers.data() + (size_t)i * IO_BUFFER, IO_BUFFER};
+        fixed = syscall(__NR_io_uring_register, ring, IORING_REGISTER_BUFFERS, iov, IO_DEPTH) == 0;
+        return true;
+    }
+
+    // queue operation for the current stage of slot
+    void prepare(int s) {
+        Slot& slot = slots[s];
+        IoTask& t = *slot.task;
+        unsigned tail = *sqtail;
+        io_uring_sqe* sqe = &sqes[tail & *sqmask];
+        memset(sqe, 0, sizeof *sqe);
+        sqe->user_data = s;
+        char* buf = buffers.data() + (size_t)s * IO_BUFFER;
+        if (slot.stage == IO_OPEN) {
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long)t.path.c_str();
+            sqe->open_flags = t.write ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDONLY | O_CLOEXEC;
+            sqe->len = 0644;
+        }
+        else if (slot.stage == IO_XFER) {
+            size_t n = IO_BUFFER;
+            if (t.write) {
+                n = std::min(n, t.data.size() - slot.off);
+                memcpy(buf, t.data.data() + slot.off, n);
+                sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+            }
+            else sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            sqe->fd = slot.fd;
+            sqe->addr = (unsigned long)buf;
+            sqe->len = n;
+            sqe->off = slot.off;
+            sqe->buf_index = s;
+        }
+        else {
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = slot.fd;
+        }
+        sqarray[tail & *sqmask] = tail & *sqmask;
+        __atomic_store_n(sqtail, tail + 1, __ATOMIC_RELEASE);
+        queued++;
+    }
+
+    // advance slot past a completed operation
+    void complete(int s, int res) {
+        Slot& slot = slots[s];
+        IoTask& t = *slot.task;
+        char* buf = buffers.data() + (size_t)s * IO_BUFFER;
+        if (slot.stage == IO_OPEN) {
+            if (res < 0) t.err = -res;
+            else {
+                slot.fd = res;
+                slot.off = 0;
+                slot.stage = t.write && t.data.empty() ? IO_CLOSE : IO_XFER;
+                return prepare(s);
+            }
+        }
+        else if (slot.stage == IO_XFER) {
+            if (res < 0) t.err = -res;
+            else {
+                if (!t.write) t.data.append(buf, res);
+                slot.off += res;
+                // a regular file reads short only at its end
+                bool more = t.write ? slot.off < t.data.size() && res > 0 : res == IO_BUFFER;
+                if (!more && t.write && slot.off < t.data.size()) t.err = EIO;
+                if (more) return prepare(s);
+            }
+            slot.stage = IO_CLOSE;
+            return prepare(s);
+        }
+        else if (res < 0 && !t.err) t.err = -res;
+
+        // open failed or file closed
+        t.done = true;
+        if (t.write) writesdone++;
+        slot.task = nullptr;
+    }
+
+    // slots with an operation in flight (each has exactly one)
+    int busy() const {
+        int n = 0;
+        for (auto& slot : slots) n += slot.task != nullptr;
+        return n;
+    }
+
+    // give free slots their next task
+    void fill() {
+        for (int s=0; s < IO_DEPTH; s++) {
+            if (slots[s].task) continue;
+            IoTask* t = take();
+            if (!t) break;
+            slots[s].task = t;
+            slots[s].stage = IO_OPEN;
+            prepare(s);
+        }
+    }
+
+    // start operations for free slots, submit them and reap completions (waiting for one if wait)
+    void pump(bool wait) {
+        fill();
+        while (true) {
+            unsigned submit = *sqtail - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE);
+            bool block = wait && busy() > 0;
+            queued = 0;
+            if (submit || block) {
+                int r = syscall(__NR_io_uring_enter, ring, submit, block ? 1 : 0, block ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+                if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                    fail();
+                    return;
+                }
+            }
+
+            // completions may start the next stage of their slot, or free it for another task
+            unsigned head = *cqhead, reaped = 0;
+            for (; head != __atomic_load_n(cqtail, __ATOMIC_ACQUIRE); head++, reaped++) {
+                io_uring_cqe* cqe = &cqes[head & *cqmask];
+                complete((int)cqe->user_data, cqe->res);
+            }
+            __atomic_store_n(cqhead, head, __ATOMIC_RELEASE);
+            fill();
+            if (!queued || !reaped) return;
+            wait = false;           // submit the follow-up operations without blocking
+        }
+    }
+
+    // ring unusable - redo operations in flight and finish the rest with blocking calls
+    void fail() {
+        mode = IO_SYNC;
+        for (auto& slot : slots) {
+            IoTask* t = slot.task;
+            if (!t) continue;
+            slot.task = nullptr;
+            if (slot.stage == IO_XFER) close(slot.fd);
+            if (!t->write) t->data.clear();
+            t->err = 0;
+            ioblocking(*t);
+            t->done = true;
+            if (t->write) writesdone++;
+        }
+        while (nextwrite < writes.size()) {
+            IoTask& t = writes[nextwrite++];
+            ioblocking(t);
+            t.done = true;
+            writesdone++;
+        }
+    }
+#endif
+};
+
+#endif
@@ -0,0 +1,307 @@
+#ifndef CASM92_H
+#define CASM92_H
+
+/*
+    Compile-Time Assembler
+    ============================================================================
+    Header-only constexpr assembler for programs embedded in C++ (eg. test harnesses),
+    so they are assembled by the compiler instead of at startup. Instruction codes are
+    computed by icodeof(), which asm92 itself uses, and the instruction mapping is read
+    from mapping.conf text with the same rules as asm92's loader.
+
+    Usage (C++20):
+        constexpr casm92::Text mapping = R"(
+            HLT : 3
+            MOV A, X : 04
+            ...
+        )";                                         // contents of mapping.conf
+        constexpr auto image = casm92::assemble<R"(
+            init:
+                mov $50, 12
+                hlt
+        )", mapping>();                             // std::array<uint8_t, N>
+
+    * Supports instructions, labels, comments, '@byte' and '@org'. The image holds the
+        bytes from the lowest to the highest address written (as asm92's dense format).
+        Relative branches use the carry adjust of the default profile unless given
+        (assemble<Src, Map, CARRY>).
+    * Errors are compile errors: constant evaluation stops at a call to the (non-constexpr)
+        function naming the error, eg. "call to non-'constexpr' function
+        'void casm92::instruction_cannot_be_mapped(int)'", with the line number as argument
+    * assembletext() may also be called at run time, where errors throw casm92::Error
+    ============================================================================
+*/
+
+#include <cstdint>
+#include <string_view>
+
+// instruction code of mnemonic (up to 3 characters) and operand types - see Instruction Map in asm92.cpp
+constexpr uint32_t icodeof(std::string_view mnemonic, int optype0, int optype1) {
+    uint32_t icode = 0;
+    for (size_t i=0; i < mnemonic.length() && i < 3; i++)
+        icode |= (uint32_t)(unsigned char)mnemonic[i] << (8 * (3-i));
+    return icode | (optype0 << 4) | (optype1 & 0x0F);
+}
+
+#if __cplusplus >= 202002L
+#include <array>
+#include <cstddef>
+
+namespace casm92 {
+
+inline constexpr int MEM_SIZE = 256;        // memory of the default profile
+inline constexpr int CARRY = 2;             // back branch carry adjust of the default profile
+inline constexpr int MAX_LABELS = 256;
+
+struct Error {
+    const char* what;
+    int line;
+};
+
+// errors - not constexpr, so reaching one during constant evaluation is a compile error naming it
+inline void invalid_mapping_line(int line) { throw Error{"Invalid format in mapping", line}; }
+inline void invalid_mnemonic(int line) { throw Error{"Invalid mnemonic", line}; }
+inline void invalid_operand(int line) { throw Error{"Invalid operand", line}; }
+inline void invalid_hex_value(int line) { throw Error{"Invalid hex value", line}; }
+inline void instruction_cannot_be_mapped(int line) { throw Error{"Invalid instruction, instruction code cannot be mapped", line}; }
+inline void neither_label_nor_immediate(int line) { throw Error{"Operand is neither a valid label or immediate address", line}; }
+inline void unsupported_directive(int line) { throw Error{"Directive not supported at compile time", line}; }
+inline void code_exceeds_memory(int line) { throw Error{"Code exceeds end of memory", line}; }
+inline void code_overlaps(int line) { throw Error{"Code overlaps code written earlier", line}; }
+inline void too_many_labels(int line) { throw Error{"Too many labels", line}; }
+
+// string literal usable as a template argument
+template <size_t N>
+struct Text {
+    char s[N];
+    constexpr Text(const char (&str)[N]) : s() {
+        for (size_t i=0; i < N; i++) s[i] = str[i];
+    }
+    constexpr std::string_view view() const { return std::string_view(s, N - 1); }
+};
+
+constexpr std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t' || s.front() == '\r')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\r')) s.remove_suffix(1);
+    return s;
+}
+
+constexpr int hexdigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// value of 1 to maxdigits hex digits, -1 if invalid
+constexpr int hexvalue(std::string_view s, size_t maxdigits) {
+    int v = 0;
+    if (s.empty() || s.length() > maxdigits) return -1;
+    for (char c : s) {
+        if (hexdigit(c) < 0) return -1;
+        v = (v << 4) | hexdigit(c);
+    }
+    return v;
+}
+
+constexpr char upper(char c) { return c >= 'a' && c <= 'z' ? c - 32 : c; }
+constexpr int width(int optype) { return optype == 0 ? 0 : optype > 2 ? 2 : 1; }
+
+// next line of text from pos
+constexpr std::string_view nextline(std::string_view text, size_t& pos) {
+    size_t end = text.find('\n', pos);
+    if (end == std::string_view::npos) end = text.length();
+    std::string_view line = text.substr(pos, end - pos);
+    pos = end + 1;
+    return line;
+}
+
+// instruction mapping, read from mapping.conf text
+struct Mapping {
+    uint32_t icode[256] = {};
+    uint8_t mpc[256] = {};
+    int size = 0;
+    constexpr int find(uint32_t ic) const {
+        for (int i=0; i < size; i++) if (icode[i] == ic) return i;
+        return -1;
+    }
+};
+
+constexpr Mapping parsemapping(std::string_view text) {
+    Mapping map;
+    int linenum = 0;
+    for (size_t pos = 0; pos < text.length(); ) {
+        std::string_view line = trim(nextline(text, pos));
+        linenum++;
+        if (line.empty() || line[0] == '#') continue;
+        size_t colon = line.rfind(':');
+        if (colon == std::string_view::npos) invalid_mapping_line(linenum);
+        std::string_view instr = trim(line.substr(0, colon)), addr = trim(line.substr(colon + 1));
+
+        char mnemonic[3] = {};
+        size_t i = 0, len = 0;
+        int numops = 0, optype[2] = {0, 0};
+        while (i < instr.length() && instr[i] != ' ') {         // read mnemonic
+            if (len == 3) invalid_mapping_line(linenum);
+            mnemonic[len++] = upper(instr[i++]);
+        }
+        while (i < instr.length()) {                             // read operands
+            char c = upper(instr[i++]);
+            if (c == ' ') continue;
+            if (c == ',' && numops == 0) numops++;
+            else if (c == 'A' || c == 'B') optype[numops] = optype[numops] == 2 ? 4 : 2;   // doubled for 2 bytes
+            else if (c == 'X') optype[numops] = optype[numops] == 1 ? 3 : 1;
+            else invalid_mapping_line(linenum);
+        }
+        int mpc = hexvalue(addr, 2);
+        if (mpc < 0) invalid_mapping_line(linenum);
+        uint32_t icode = icodeof(std::string_view(mnemonic, len), optype[0], optype[1]);
+        int at = map.find(icode);
+        if (at < 0) {
+            if (map.size == 256) invalid_mapping_line(linenum);
+            at = map.size++;
+        }
+        map.icode[at] = icode;
+        map.mpc[at] = mpc;
+    }
+    return map;
+}
+
+struct Image {
+    uint8_t bytes[MEM_SIZE] = {};
+    bool used[MEM_SIZE] = {};
+    int lo = MEM_SIZE, hi = 0;              // populated address range [lo, hi)
+};
+
+// assemble program text (two passes - labels, then code)
+constexpr Image assembletext(std::string_view src, const Mapping& map, int carry = CARRY) {
+    struct Label {
+        std::string_view name;
+        int addr;
+    };
+    Label labels[MAX_LABELS] = {};
+    int nlabels = 0;
+    Image img;
+    auto label = [&](std::string_view name) {
+        for (int k=0; k < nlabels; k++) if (labels[k].name == name) return labels[k].addr;
+        return -1;
+    };
+    auto emit = [&](int addr, int byte, int linenum) {
+        if (addr >= MEM_SIZE) code_exceeds_memory(linenum);
+        if (img.used[addr]) code_overlaps(linenum);
+        img.bytes[addr] = byte;
+        img.used[addr] = true;
+        if (addr < img.lo) img.lo = addr;
+        if (addr + 1 > img.hi) img.hi = addr + 1;
+    };
+
+    for (int pass = 0; pass < 2; pass++) {
+        int addr = 0, linenum = 0;
+        for (size_t pos = 0; pos < src.length(); ) {
+            std::string_view line = trim(nextline(src, pos));
+            linenum++;
+            if (line.empty() || line[0] == '#') continue;
+            std::string_view code = trim(line.substr(0, line.find('#')));
+
+            if (line[0] == '@') {
+                if (code.substr(0, 4) == "@org" && code.find('=') != std::string_view::npos) {
+                    if ((addr = hexvalue(trim(code.substr(code.find('=') + 1)), 2)) < 0) invalid_hex_value(linenum);
+                }
+                else if (code.substr(0, 5) == "@byte" && (code.length() == 5 || code[5] == ' ' || code[5] == '\t')) {
+                    for (std::string_view args = code.substr(5); !trim(args).empty(); ) {
+                        size_t comma = args.find(',');
+                        std::string_view arg = trim(args.substr(0, comma));
+                        int v = label(arg);
+                        if (v < 0) v = hexvalue(arg, 2);
+                        if (v < 0 && pass == 1) invalid_hex_value(linenum);
+                        if (pass == 1) emit(addr, v, linenum);
+                        addr++;
+                        args = comma == std::string_view::npos ? std::string_view() : args.substr(comma + 1);
+                    }
+                }
+                else unsupported_directive(linenum);
+                continue;
+            }
+
+            size_t colon = line.rfind(':');                     // label (anything preceding the last colon)
+            if (colon != std::string_view::npos) {
+                if (pass == 0) {                                // a redefinition replaces the address
+                    std::string_view name = trim(line.substr(0, colon));
+                    int k = 0;
+                    while (k < nlabels && labels[k].name != name) k++;
+                    if (k == MAX_LABELS) too_many_labels(linenum);
+                    if (k == nlabels) nlabels++;
+                    labels[k] = {name, addr};
+                }
+                continue;
+            }
+
+            // mnemonic
+            char mnemonic[3] = {};
+            size_t i = 0, len = 0;
+            while (i < code.length() && code[i] != ' ' && code[i] != '\t') {
+                if (len == 3) invalid_mnemonic(linenum);
+                mnemonic[len++] = upper(code[i++]);
+            }
+            std::string_view m(mnemonic, len), rest = trim(code.substr(i));
+            int ops[2] = {0, 0}, optype[2] = {0, 0}, digits[2] = {0, 0}, numops = 0;
+            bool jump = m == "JMP" || m == "JSR" || m == "BR" || m == "BRZ" || m == "BRN";
+
+            if (jump) {                                         // label or 1 byte immediate
+                optype[0] = 1;
+                int to = label(rest);
+                if (to >= 0) ops[0] = m[0] != 'B' ? to : (to - (addr + (to < addr ? carry : 1))) & 0xFF;
+                else if ((ops[0] = hexvalue(rest, 2)) < 0) {
+                    if (pass == 1) neither_label_nor_immediate(linenum);
+                    ops[0] = 0;
+                }
+            }
+            else {
+                for (char c : rest) {                           // operands, as parsed by asm92
+                    c = upper(c);
+                    if (c == ' ' || c == '\t') continue;
+                    if (c == '$') optype[numops] = 2;
+                    else if (c == ',') {
+                        if (numops++) invalid_operand(linenum);
+                    }
+                    else if (c == 'X' && digits[numops] == 1 && ops[numops] == 0) digits[numops] = 0;    // '0x' prefix
+                    else if (hexdigit(c) >= 0) {
+                        ops[numops] = (ops[numops] << 4) | hexdigit(c);
+                        digits[numops]++;
+                        if (optype[numops] == 0) optype[numops] = 1;
+                    }
+                    else invalid_operand(linenum);
+                }
+                for (int k=0; k < 2; k++) {
+                    if (digits[k] > 4) invalid_operand(linenum);
+                    if (digits[k] > 2 && ops[k] > 0xFF) optype[k] += 2;     // leading zeros alone do not widen (as asm92 with 256 bytes)
+                }
+            }
+
+            int at = map.find(icodeof(m, optype[0], optype[1]));
+            if (at < 0) instruction_cannot_be_mapped(linenum);
+            if (pass == 1) {
+                int a = addr;
+                emit(a++, map.mpc[at], linenum);
+                for (int k=0; k < 2; k++)                       // 2 byte operands low byte first
+                    for (int b=0; b < width(optype[k]); b++) emit(a++, (ops[k] >> (8*b)) & 0xFF, linenum);
+            }
+            addr += 1 + width(optype[0]) + width(optype[1]);
+        }
+    }
+    return img;
+}
+
+// assemble program at compile time into image of its populated address range
+template <Text Src, Text Map, int Carry = CARRY>
+constexpr auto assemble() {
+    constexpr Image img = assembletext(Src.view(), parsemapping(Map.view()), Carry);
+    std::array<uint8_t, (img.hi > img.lo ? img.hi - img.lo : 0)> out = {};
+    for (size_t i=0; i < out.size(); i++) out[i] = img.bytes[img.lo + i];
+    return out;
+}
+
+}
+#endif
+
+#endif
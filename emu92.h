@@ -0,0 +1,290 @@
+#ifndef EMU92_H
+#define EMU92_H
+
+/*
+    ISA Emulator
+    ============================================================================
+    Executes assembled programs instruction by instruction. Opcodes are MPC
+    addresses, so the decode table is built from the instruction mapping
+    (mapping.conf) rather than fixed here.
+
+    Dispatch:
+        * The instruction set is one descriptor, EMU_ISA, with a row per mnemonic
+            giving its semantics. Instruction kinds, the mnemonic lookup and the
+            handlers are all generated from it, so an instruction is added with a row.
+        * A handler is generated for every kind and combination of operand types at
+            compile time, so operand fetch, instruction size and the addressing mode
+            are fixed in each handler rather than tested while running
+        * Loading the mapping binds each opcode to the handler of its kind and operand
+            types, and each step is one indirect call through that table
+
+    Timing:
+        * By default each instruction costs the cycles of the target profile's cost model
+            (opcode fetch, plus a cost per operand byte). In timing mode it costs the fetch
+            plus the length of its microroutine, from a table indexed by MPC address (the
+            opcode), with a second length for when a branch is taken.
+        * Timing is a template parameter of the handlers, so the lookup (and the test of
+            whether a branch was taken) is only compiled into the timing handlers
+        * Long programs are timed in full rather than sampled: there is no slower microcode
+            simulator to fast-forward against, and timing mode costs about 11% of the speed
+            of the cost model (57.7 vs 64.7 M instructions/s on a 10M step loop)
+        * If the machine has a hit map, the timing handlers count each run of a microroutine,
+            by opcode and whether its branch was taken, for profiling the microstore
+
+    Coverage:
+        * If the machine has an edge map, each jump, branch, call and return executed
+            counts its edge (from, to) in a hashed slot of the map, for fuzzing (only
+            those handlers test for the map)
+
+    Machine model (assumed from the ISA, not from the microcode):
+        * MOV/ADD/SUB/AND/OR/INV/NEG write their first operand. ALU instructions and
+            CMP set the flags, CMP from the first operand minus the second (or from the
+            operand itself if it has one operand)
+        * Flags are Z (0x01), N (0x02), V (0x04) and C (0x08), mirrored to the PSW
+            register at I/O base + 8 after every ALU instruction
+        * BR/BRZ/BRN are relative to the opcode address, back branches adjusted for the
+            ALU carry (see ALU_CARRY_ADJUST), JMP/JSR are absolute
+        * The stack grows downward: PSH stores at SP then decrements, POP increments
+            then loads. JSR pushes the return address (2 bytes, high first, when
+            addresses are 2 bytes), RTS pops it.
+        * Writes to the output register (I/O base + 0) are recorded as program output.
+            WTI loads the next input byte into the input register (I/O base + 4), the
+            program halts once input runs out.
+
+    Bank-Switch Device:
+        * Register at I/O base + 0x0C (0xCC). Writing overlay number N copies overlay N
+            from its bank into the overlay window, reading returns the loaded overlay
+            (0xFF if none). Writing the overlay already loaded costs nothing, writing a
+            number with no overlay (eg. 0xFF) leaves the window as it is.
+        * Each load counts as a swap and costs 1 cycle per byte copied
+    ============================================================================
+*/
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <array>
+#include <utility>
+
+#define EMU_STEP_LIMIT 10000000     // instructions executed before a program is assumed not to halt
+#define BANK_OFFSET 0x0C            // bank-switch register, from I/O base
+#define EMU_EDGES 8192              // slots of coverage edge map (power of 2)
+
+#define EMU_MODES 5                 // operand types: 0 none, as in the assembler 1 immediate, 2 direct, 3/4 the 2 byte forms
+
+/*
+    ISA Descriptor
+    - One row per instruction: the mnemonic, then its semantics
+    - Semantics see the operands as raw[k] (the immediate or address as encoded) and a, b
+        (the values they denote - the immediate itself, or the byte at the address), and
+        next, the address of the following instruction. numops and imm0 (first operand is
+        immediate) are compile-time constants. A row returns a state to stop without
+        advancing the PC.
+*/
+#define EMU_ISA(X) \
+    X(HLT, return EMU_HALTED;) \
+    X(NOP, ) \
+    X(MOV, emustore(m, raw[0], b);) \
+    X(ADD, r = a + b; emuflags(m, r, r > 0xFF, ~(a ^ b) & (a ^ r) & 0x80); emustore(m, raw[0], r);) \
+    X(SUB, r = a - b; emuflags(m, r, a >= b, (a ^ b) & (a ^ r) & 0x80); emustore(m, raw[0], r);) \
+    X(AND, emuflags(m, r = a & b, false, false); emustore(m, raw[0], r);) \
+    X(OR,  emuflags(m, r = a | b, false, false); emustore(m, raw[0], r);) \
+    X(INV, emuflags(m, r = ~a, false, false); emustore(m, raw[0], r);) \
+    X(NEG, emuflags(m, r = -a, a != 0, a == 0x80); emustore(m, raw[0], r);) \
+    X(CMP, r = numops == 2 ? a - b : a; emuflags(m, r, numops == 2 && a >= b, numops == 2 && ((a ^ b) & (a ^ r) & 0x80));) \
+    X(BR,  next = emubranch(m, raw[0]);) \
+    X(BRZ, if (m.flags & 0x01) next = emubranch(m, raw[0]);) \
+    X(BRN, if (m.flags & 0x02) next = emubranch(m, raw[0]);) \
+    X(JMP, next = raw[0] % m.memsize;) \
+    X(JSR, if (m.wide) emupush(m, next >> 8); emupush(m, next); next = raw[0] % m.memsize;) \
+    X(RTS, next = emupop(m); if (m.wide) next |= emupop(m) << 8;) \
+    X(LSP, m.sp = imm0 ? raw[0] : a;) \
+    X(SSP, emustore(m, raw[0], m.sp);) \
+    X(PSH, emupush(m, a);) \
+    X(POP, emustore(m, raw[0], emupop(m));) \
+    X(WTI, if (m.inpos >= m.input.size()) return EMU_HALTED; emustore(m, m.iofirst + 4, m.input[m.inpos++]);)
+
+#define EMU_ENUM(name, ...) EMU_##name,
+enum EmuKind { EMU_NONE, EMU_ISA(EMU_ENUM) EMU_KINDS };
+#undef EMU_ENUM
+enum EmuState { EMU_RUNNING, EMU_HALTED, EMU_FAULT, EMU_LIMIT };
+
+struct Machine;
+typedef EmuState (*EmuHandler)(Machine&);
+
+struct Machine {
+    EmuHandler exec[256];       // handler of each opcode
+    int carry;                  // back branch adjustment
+    int iofirst;                // I/O base (output register)
+    int memsize;
+    int fetch, operand;         // cost model - cycles to fetch an opcode, and each operand byte
+    bool wide;                  // addresses are 2 bytes
+    int routine[256][2];        // timing mode - cycles of the microroutine at each MPC, [1] when its branch is taken
+
+    std::vector<unsigned char> mem;
+    int pc = 0, sp = 0;
+    unsigned char flags = 0;
+
+    int window = -1;                                // overlay window address
+    std::vector<std::vector<unsigned char>> banks;  // overlay images
+    int bank = 0xFF;                                // overlay loaded in window
+
+    std::vector<unsigned char> input, output;
+    size_t inpos = 0;
+    EmuState state = EMU_RUNNING;
+    long steps = 0, cycles = 0, swaps = 0;
+
+    unsigned char* edges = nullptr;     // hit counts of EMU_EDGES edge slots, or null
+    long* hits = nullptr;               // timing mode - runs of the routine of each opcode, [2*op] and [2*op + 1] if taken, or null
+};
+
+// instruction kind of a mnemonic
+EmuKind emukind(const std::string& mnemonic) {
+#define EMU_NAME(name, ...) #name,
+    static const char* names[] = {"", EMU_ISA(EMU_NAME)};
+#undef EMU_NAME
+    for (int k=1; k < EMU_KINDS; k++) if (mnemonic == names[k]) return (EmuKind)k;
+    return EMU_NONE;
+}
+
+unsigned char emuload(Machine& m, int addr) {
+    addr %= m.memsize;
+    if (addr == m.iofirst + BANK_OFFSET && m.window >= 0) return m.bank;
+    return m.mem[addr];
+}
+
+void emustore(Machine& m, int addr, unsigned char v) {
+    addr %= m.memsize;
+    m.mem[addr] = v;
+    if (addr == m.iofirst) m.output.push_back(v);
+    if (addr == m.iofirst + BANK_OFFSET && m.window >= 0 && v != m.bank) {     // bank switch
+        if (v < m.banks.size()) {
+            const std::vector<unsigned char>& img = m.banks[v];
+            std::copy(img.begin(), img.end(), m.mem.begin() + m.window);
+            m.swaps++;
+            m.cycles += img.size();
+        }
+        m.bank = v;
+    }
+}
+
+void emuflags(Machine& m, int result, bool carry, bool overflow) {
+    m.flags = ((result & 0xFF) == 0 ? 0x01 : 0) | (result & 0x80 ? 0x02 : 0) | (overflow ? 0x04 : 0) | (carry ? 0x08 : 0);
+    m.mem[(m.iofirst + 8) % m.memsize] = m.flags;
+}
+
+void emupush(Machine& m, unsigned char v) {
+    emustore(m, m.sp, v);
+    m.sp = (m.sp + m.memsize - 1) % m.memsize;
+}
+
+unsigned char emupop(Machine& m) {
+    m.sp = (m.sp + 1) % m.memsize;
+    return emuload(m, m.sp);
+}
+
+// target of a taken branch at PC, back branches adjusted for the ALU carry
+int emubranch(Machine& m, int raw) {
+    signed char off = (signed char)raw;
+    return (m.pc + (off < 0 ? m.carry : 1) + off + m.memsize) % m.memsize;
+}
+
+// instructions that transfer control, whose edges are counted for coverage
+constexpr bool emucontrol(EmuKind k) {
+    return k == EMU_BR || k == EMU_BRZ || k == EMU_BRN || k == EMU_JMP || k == EMU_JSR || k == EMU_RTS;
+}
+
+// count edge in coverage map (saturating)
+inline void emuedge(Machine& m, int from, int to) {
+    unsigned char& hits = m.edges[((unsigned)from * 0x9E3779B1u ^ (unsigned)to * 0x85EBCA6Bu) >> 16 & (EMU_EDGES - 1)];
+    if (hits < 255) hits++;
+}
+
+// semantics of each instruction kind, from its descriptor row
+template <EmuKind K> struct EmuSem;
+#define EMU_SEM(name, ...) \
+    template <> struct EmuSem<EMU_##name> { \
+        template <int numops, bool imm0> \
+        static EmuState exec(Machine& m, const int* raw, int a, int b, int& next) { \
+            [[maybe_unused]] int r = 0; \
+            __VA_ARGS__ \
+            return EMU_RUNNING; \
+        } \
+    };
+EMU_ISA(EMU_SEM)
+#undef EMU_SEM
+
+// fetch operand of type T at address at, returns the value it denotes
+template <int T>
+inline int emufetch(Machine& m, int& at, int& raw) {
+    raw = m.mem[at++ % m.memsize];
+    if (T > 2) raw |= m.mem[at++ % m.memsize] << 8;
+    return T == 2 || T == 4 ? emuload(m, raw) : raw & 0xFF;
+}
+
+// execute one instruction of kind K with operand types T0, T1, charging its microroutine if Timing
+template <EmuKind K, int T0, int T1, bool Timing>
+EmuState emuexec(Machine& m) {
+    constexpr int size = 1 + (T0 + 1) / 2 + (T1 + 1) / 2;
+    int raw[2] = {0, 0}, val[2] = {0, 0}, at = m.pc + 1;
+    if constexpr (T0 > 0) val[0] = emufetch<T0>(m, at, raw[0]);
+    if constexpr (T1 > 0) val[1] = emufetch<T1>(m, at, raw[1]);
+    int next = (m.pc + size) % m.memsize;
+    m.steps++;
+    [[maybe_unused]] int fall = next, op = 0;
+    if constexpr (Timing) op = m.mem[m.pc];         // before the instruction can overwrite its opcode
+    else m.cycles += m.fetch + (size - 1) * m.operand;
+    EmuState s = EmuSem<K>::template exec<(T0 > 0) + (T1 > 0), T0 == 1 || T0 == 3>(m, raw, val[0], val[1], next);
+    if constexpr (Timing) {
+        int taken = emucontrol(K) && next != fall;
+        m.cycles += m.fetch + m.routine[op][taken];
+        if (m.hits) m.hits[2*op + taken]++;
+    }
+    if (s != EMU_RUNNING) return m.state = s;
+    if constexpr (emucontrol(K)) if (m.edges) emuedge(m, m.pc, next);
+    m.pc = next;
+    return m.state;
+}
+
+EmuState emufault(Machine& m) {
+    return m.state = EMU_FAULT;
+}
+
+// handler table over kind x first operand type x second operand type, built at compile time
+template <size_t I, bool Timing>
+constexpr EmuHandler emuhandler() {
+    constexpr int k = I / (EMU_MODES * EMU_MODES), t0 = I / EMU_MODES % EMU_MODES, t1 = I % EMU_MODES;
+    if constexpr (k == EMU_NONE || (t0 == 0 && t1 > 0)) return emufault;
+    else return emuexec<(EmuKind)k, t0, t1, Timing>;
+}
+
+template <bool Timing, size_t... I>
+constexpr std::array<EmuHandler, sizeof...(I)> emuhandlers(std::index_sequence<I...>) {
+    return {{emuhandler<I, Timing>()...}};
+}
+
+template <bool Timing>
+constexpr std::array<EmuHandler, EMU_KINDS * EMU_MODES * EMU_MODES> emutable =
+    emuhandlers<Timing>(std::make_index_sequence<EMU_KINDS * EMU_MODES * EMU_MODES>());
+
+// handler of an instruction, in timing mode if timing
+EmuHandler emuhandler(EmuKind kind, int optype0, int optype1, bool timing = false) {
+    if (optype0 >= EMU_MODES || optype1 >= EMU_MODES) return emufault;
+    int i = (kind * EMU_MODES + optype0) * EMU_MODES + optype1;
+    return timing ? emutable<true>[i] : emutable<false>[i];
+}
+
+// execute one instruction
+EmuState step(Machine& m) {
+    if (m.state != EMU_RUNNING) return m.state;
+    return m.exec[m.mem[m.pc]](m);
+}
+
+// run until the program halts or faults, or the step limit is reached
+EmuState run(Machine& m, long limit = EMU_STEP_LIMIT) {
+    while (m.state == EMU_RUNNING && m.steps < limit) step(m);
+    if (m.state == EMU_RUNNING) m.state = EMU_LIMIT;
+    return m.state;
+}
+
+#endif
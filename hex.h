@@ -0,0 +1,113 @@
+#ifndef HEX_H
+#define HEX_H
+
+/*
+    Hex Conversion
+    - hexval maps every character to its hex digit value, or 0xFF if it is not a hex
+        digit (either case), replacing range checks on every character
+    - hexdecode converts a string of hex digit pairs to bytes. Long strings (eg. @data
+        tables) are decoded 32 characters at a time with AVX2 when the CPU supports it,
+        otherwise 16 at a time with SSE2, with the lookup table finishing the remainder
+        and serving as the fallback on other architectures.
+    - hexstr holds the two hex digits of every byte value, for output formatting
+*/
+
+#include <cstddef>
+#include <cstdint>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HEX_SIMD
+#endif
+
+struct HexTable {
+    unsigned char v[256];
+    constexpr HexTable() : v() {
+        for (int i=0; i < 256; i++) v[i] = 0xFF;
+        for (int i=0; i < 10; i++) v['0' + i] = i;
+        for (int i=0; i < 6; i++) {
+            v['A' + i] = 10 + i;
+            v['a' + i] = 10 + i;
+        }
+    }
+    constexpr unsigned char operator[](unsigned char c) const { return v[c]; }
+};
+constexpr HexTable hexval;
+
+// two uppercase hex digits of every byte value, for formatting without per-digit arithmetic
+struct HexStrings {
+    char v[256][2];
+    constexpr HexStrings() : v() {
+        for (int i=0; i < 256; i++) {
+            v[i][0] = "0123456789ABCDEF"[i >> 4];
+            v[i][1] = "0123456789ABCDEF"[i & 0x0F];
+        }
+    }
+    constexpr const char* operator[](unsigned char b) const { return v[b]; }
+};
+constexpr HexStrings hexstr;
+
+// decode n hex digit pairs with lookup table, returns false if a character is not a hex digit
+inline bool hexdecode_scalar(const char* s, size_t n, unsigned char* out) {
+    unsigned char bad = 0;
+    for (size_t i=0; i < n; i++) {
+        unsigned char hi = hexval[s[2*i]], lo = hexval[s[2*i+1]];
+        bad |= hi | lo;                 // invalid digits have high bit set
+        out[i] = (hi << 4) | (lo & 0x0F);
+    }
+    return !(bad & 0x80);
+}
+
+#ifdef HEX_SIMD
+// nibble value of each of 16 characters, and mask of lanes that are hex digits
+inline __m128i hexnibbles_sse2(__m128i v, __m128i& ok) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    __m128i l = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));     // fold case
+    __m128i isd = _mm_cmpeq_epi8(_mm_subs_epu8(d, _mm_set1_epi8(9)), zero);                // d <= 9
+    __m128i isl = _mm_cmpeq_epi8(_mm_subs_epu8(l, _mm_set1_epi8(5)), zero);                // l <= 5
+    ok = _mm_or_si128(isd, isl);
+    return _mm_or_si128(_mm_and_si128(isd, d), _mm_and_si128(isl, _mm_add_epi8(l, _mm_set1_epi8(10))));
+}
+
+// decode 16 characters to 8 bytes
+inline bool hexdecode_sse2(const char* s, unsigned char* out) {
+    __m128i ok;
+    __m128i n = hexnibbles_sse2(_mm_loadu_si128((const __m128i*)s), ok);
+    __m128i hi = _mm_slli_epi16(_mm_and_si128(n, _mm_set1_epi16(0x00FF)), 4);               // first char of each pair
+    __m128i b = _mm_or_si128(hi, _mm_srli_epi16(n, 8));
+    _mm_storel_epi64((__m128i*)out, _mm_packus_epi16(b, b));
+    return _mm_movemask_epi8(ok) == 0xFFFF;
+}
+
+// decode 32 characters to 16 bytes
+__attribute__((target("avx2")))
+inline bool hexdecode_avx2(const char* s, unsigned char* out) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i v = _mm256_loadu_si256((const __m256i*)s);
+    __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+    __m256i l = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    __m256i isd = _mm256_cmpeq_epi8(_mm256_subs_epu8(d, _mm256_set1_epi8(9)), zero);
+    __m256i isl = _mm256_cmpeq_epi8(_mm256_subs_epu8(l, _mm256_set1_epi8(5)), zero);
+    __m256i n = _mm256_or_si256(_mm256_and_si256(isd, d), _mm256_and_si256(isl, _mm256_add_epi8(l, _mm256_set1_epi8(10))));
+    __m256i hi = _mm256_slli_epi16(_mm256_and_si256(n, _mm256_set1_epi16(0x00FF)), 4);
+    __m256i b = _mm256_or_si256(hi, _mm256_srli_epi16(n, 8));
+    b = _mm256_permute4x64_epi64(_mm256_packus_epi16(b, b), 0x08);                          // packus works per 128 bit lane
+    _mm_storeu_si128((__m128i*)out, _mm256_castsi256_si128(b));
+    return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(isd, isl)) == 0xFFFFFFFFu;
+}
+#endif
+
+// decode n hex digit pairs (2n characters) to n bytes, returns false if a character is not a hex digit
+inline bool hexdecode(const char* s, size_t n, unsigned char* out) {
+    size_t i = 0;
+    bool ok = true;
+#ifdef HEX_SIMD
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2)
+        for (; i + 16 <= n; i += 16) ok &= hexdecode_avx2(s + 2*i, out + i);
+    for (; i + 8 <= n; i += 8) ok &= hexdecode_sse2(s + 2*i, out + i);
+#endif
+    return hexdecode_scalar(s + 2*i, n - i, out + i) && ok;
+}
+
+#endif
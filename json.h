@@ -0,0 +1,195 @@
+#ifndef JSON_H
+#define JSON_H
+
+/*
+    JSON
+    - Minimal JSON value, parser and serializer for the JSON-RPC messages of the language
+        server (see asm92.cpp). Numbers are held as doubles, objects as sorted maps.
+    - Parsing is lenient about what it does not need (eg. \u escapes outside ASCII are
+        replaced by '?'), and returns a null value for malformed input
+*/
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+
+struct Json {
+    enum Type { NUL, BOOL, NUM, STR, ARR, OBJ } type = NUL;
+    bool b = false;
+    double num = 0;
+    std::string str;
+    std::vector<Json> arr;
+    std::map<std::string,Json> obj;
+
+    Json() {}
+    Json(bool v) : type(BOOL), b(v) {}
+    Json(int v) : type(NUM), num(v) {}
+    Json(long v) : type(NUM), num(v) {}
+    Json(double v) : type(NUM), num(v) {}
+    Json(const char* v) : type(STR), str(v) {}
+    Json(const std::string& v) : type(STR), str(v) {}
+
+    static Json array() { Json j; j.type = ARR; return j; }
+    static Json object() { Json j; j.type = OBJ; return j; }
+
+    // member of object (null if absent), inserting converts null to object
+    const Json& operator[](const std::string& key) const {
+        static const Json none;
+        auto it = obj.find(key);
+        return it == obj.end() ? none : it->second;
+    }
+    Json& operator[](const std::string& key) {
+        type = OBJ;
+        return obj[key];
+    }
+    bool has(const std::string& key) const { return obj.find(key) != obj.end(); }
+    void push(const Json& v) {
+        type = ARR;
+        arr.push_back(v);
+    }
+    int integer() const { return (int)num; }
+};
+
+// append JSON text of value to buffer
+inline void jsondump(const Json& j, std::string& buf) {
+    char tmp[32];
+    switch (j.type) {
+        case Json::NUL: buf += "null"; break;
+        case Json::BOOL: buf += j.b ? "true" : "false"; break;
+        case Json::NUM:
+            if (j.num == (long)j.num) snprintf(tmp, sizeof tmp, "%ld", (long)j.num);
+            else snprintf(tmp, sizeof tmp, "%.17g", j.num);
+            buf += tmp;
+            break;
+        case Json::STR:
+            buf += '"';
+            for (unsigned char c : j.str) {
+                if (c == '"' || c == '\\') {
+                    buf += '\\';
+                    buf += c;
+                }
+                else if (c == '\n') buf += "\\n";
+                else if (c == '\t') buf += "\\t";
+                else if (c < 0x20) {
+                    snprintf(tmp, sizeof tmp, "\\u%04x", c);
+                    buf += tmp;
+                }
+                else buf += c;
+            }
+            buf += '"';
+            break;
+        case Json::ARR:
+            buf += '[';
+            for (size_t i=0; i < j.arr.size(); i++) {
+                if (i) buf += ',';
+                jsondump(j.arr[i], buf);
+            }
+            buf += ']';
+            break;
+        case Json::OBJ: {
+            buf += '{';
+            bool first = true;
+            for (auto& m : j.obj) {
+                if (!first) buf += ',';
+                first = false;
+                jsondump(Json(m.first), buf);
+                buf += ':';
+                jsondump(m.second, buf);
+            }
+            buf += '}';
+            break;
+        }
+    }
+}
+
+inline std::string jsondump(const Json& j) {
+    std::string buf;
+    jsondump(j, buf);
+    return buf;
+}
+
+// parse JSON value starting at pos, returns false on malformed input
+inline bool jsonparse(const std::string& s, size_t& pos, Json& out, int depth = 0) {
+    auto ws = [&]() { while (pos < s.length() && isspace((unsigned char)s[pos])) pos++; };
+    ws();
+    if (pos >= s.length() || depth > 64) return false;
+    char c = s[pos];
+    if (c == '{' || c == '[') {
+        out = c == '{' ? Json::object() : Json::array();
+        char close = c == '{' ? '}' : ']';
+        pos++;
+        ws();
+        if (pos < s.length() && s[pos] == close) {
+            pos++;
+            return true;
+        }
+        while (true) {
+            Json key, val;
+            if (close == '}') {
+                if (!jsonparse(s, pos, key, depth+1) || key.type != Json::STR) return false;
+                ws();
+                if (pos >= s.length() || s[pos++] != ':') return false;
+            }
+            if (!jsonparse(s, pos, val, depth+1)) return false;
+            if (close == '}') out.obj[key.str] = std::move(val);
+            else out.arr.push_back(std::move(val));
+            ws();
+            if (pos >= s.length()) return false;
+            if (s[pos] == ',') {
+                pos++;
+                continue;
+            }
+            return s[pos++] == close;
+        }
+    }
+    if (c == '"') {
+        out = Json("");
+        pos++;
+        while (pos < s.length() && s[pos] != '"') {
+            c = s[pos++];
+            if (c != '\\') {
+                out.str += c;
+                continue;
+            }
+            if (pos >= s.length()) return false;
+            c = s[pos++];
+            switch (c) {
+                case 'n': out.str += '\n'; break;
+                case 't': out.str += '\t'; break;
+                case 'r': out.str += '\r'; break;
+                case 'b': out.str += '\b'; break;
+                case 'f': out.str += '\f'; break;
+                case 'u': {
+                    if (pos + 4 > s.length()) return false;
+                    long u = strtol(s.substr(pos, 4).c_str(), nullptr, 16);
+                    out.str += u < 0x80 ? (char)u : '?';
+                    pos += 4;
+                    break;
+                }
+                default: out.str += c;
+            }
+        }
+        return pos++ < s.length();
+    }
+    if (s.compare(pos, 4, "true") == 0)  { out = Json(true); pos += 4; return true; }
+    if (s.compare(pos, 5, "false") == 0) { out = Json(false); pos += 5; return true; }
+    if (s.compare(pos, 4, "null") == 0)  { out = Json(); pos += 4; return true; }
+    char* end;
+    double v = strtod(s.c_str() + pos, &end);
+    if (end == s.c_str() + pos) return false;
+    out = Json(v);
+    pos = end - s.c_str();
+    return true;
+}
+
+inline Json jsonparse(const std::string& s) {
+    Json j;
+    size_t pos = 0;
+    if (!jsonparse(s, pos, j)) return Json();
+    return j;
+}
+
+#endif
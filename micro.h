@@ -0,0 +1,398 @@
+#ifndef MICRO_H
+#define MICRO_H
+
+/*
+    Microcode Linker
+    ============================================================================
+    Lays out microroutines in the microstore and regenerates the mapping from ISA
+    instructions to MPC addresses, so that mapping.conf no longer needs to be
+    maintained by hand when a microroutine changes length.
+
+    Microroutine source syntax:
+        # this is a comment
+        ADD A, X :          // routine for instruction pattern (as in mapping.conf)
+            0A1F            // one control word per line, in hex
+            8003
+        .FETCH : 00         // routine pinned at MPC 0x00. Names starting with '.' are
+            ...             //   not ISA instructions and are not written to mapping.conf
+
+    Layout:
+        * Microroutines run sequentially from their MPC address, so a routine whose
+            control words are exactly the final words of a longer routine does not need
+            storage of its own - it is entered part way through the longer one.
+            Identical routines share all of their words.
+        * Pinned routines are placed first, then the remaining routines are packed
+            (longest first) into the lowest free block of the microstore that fits
+        * Outputs the microstore ROM as a Logisim "v2.0 raw" image and the regenerated
+            mapping.conf
+
+    Compaction:
+        * Given the fields of the control word, routines are compacted before they are laid
+            out, merging microoperations that do not conflict into fewer control words, so
+            every instruction whose routine shrinks takes fewer cycles
+        * Field definition syntax (one field per line, bit positions in hex):
+            # NAME : HIGH LOW [reads RES ...] [writes RES ...] [sequence]
+            ALU : F C reads A B writes ACC F    // bits 15-12
+            NEXT : 3 0 sequence                 // field that changes the MPC
+          A field whose bits are non-zero in a word is a microoperation of that word, and
+            reads and writes the named resources (registers, buses, flags...). A field that
+            is zero does nothing.
+        * Each word of a routine, in order, is merged into the earliest control word it can
+            join: after every word that writes what it reads or writes, or that uses one of
+            its fields, no earlier than any word that reads what it writes (reads take place
+            before writes within a cycle), and sharing no field with the words already there
+        * Words using a sequence field end a control word, and nothing moves above them.
+            Words that are zero (wait cycles) or have bits outside every field are left
+            alone, as their own control word.
+        * As in layout, routines are assumed not to branch into each other except to pinned
+            routines (eg. back to .FETCH), whose addresses do not change
+    ============================================================================
+*/
+
+#include "strim.h"
+#include "hex.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+
+#define MICROSTORE_SIZE 256     // microstore words (MPC addresses are 1 byte)
+
+struct Microroutine {
+    std::string name;                   // instruction pattern, or '.' prefixed name
+    std::vector<std::string> words;     // control words in hex (uppercase, no leading zeros)
+    int fixed;                          // pinned MPC address (-1 if none)
+    int addr;                           // assigned MPC address
+    int host;                           // index of routine whose words this one shares (-1 if none)
+    int linenum;
+};
+
+// read microroutine source file, exits on error
+std::vector<Microroutine> readroutines(const std::string& filename) {
+    std::vector<Microroutine> routines;
+    std::ifstream in(filename);
+    std::string line, word;
+    int linenum = 0;
+    if (!in.is_open()) {
+        std::cerr << "Error opening " << filename << ".\n";
+        exit(EXIT_FAILURE);
+    }
+    while (getline(in, line)) {
+        linenum++;
+        line = line.substr(0, line.find('#'));
+        line = trim(line);
+        if (line == "") continue;
+
+        size_t colon = line.find(':');
+        if (colon != std::string::npos) {              // routine header
+            Microroutine r;
+            r.name = line.substr(0, colon);
+            r.name = trim(r.name);
+            word = line.substr(colon + 1);
+            word = trim(word);
+            r.fixed = -1;
+            r.addr = -1;
+            r.host = -1;
+            r.linenum = linenum;
+            if (word != "") {
+                r.fixed = 0;
+                for (char c : word) {
+                    if (hexval[c] > 15 || r.fixed >= MICROSTORE_SIZE) {
+                        std::cerr << "Error: Invalid MPC address: \"" << word << "\" [line " << linenum << "]\n";
+                        exit(EXIT_FAILURE);
+                    }
+                    r.fixed = (r.fixed << 4) | hexval[c];
+                }
+            }
+            if (r.name == "") {
+                std::cerr << "Error: Missing routine name [line " << linenum << "]\n";
+                exit(EXIT_FAILURE);
+            }
+            routines.push_back(r);
+            continue;
+        }
+        if (routines.empty() || line.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+            std::cerr << "Error: Invalid control word: \"" << line << "\" [line " << linenum << "]\n";
+            exit(EXIT_FAILURE);
+        }
+        std::transform(line.begin(), line.end(), line.begin(), ::toupper);
+        line.erase(0, std::min(line.find_first_not_of('0'), line.length() - 1));      // normalize so 00A1 == A1
+        routines.back().words.push_back(line);
+    }
+    for (auto& r : routines)
+        if (r.words.empty()) {
+            std::cerr << "Error: Routine \"" << r.name << "\" has no control words [line " << r.linenum << "]\n";
+            exit(EXIT_FAILURE);
+        }
+    return routines;
+}
+
+struct Microfield {
+    std::string name;
+    uint64_t mask;                      // bits of control word
+    uint64_t reads, writes;             // resources, one bit each
+    bool sequence;                      // changes the MPC
+};
+
+// read control word field definitions, exits on error
+std::vector<Microfield> readfields(const std::string& filename) {
+    std::vector<Microfield> fields;
+    std::map<std::string,int> resources;
+    std::ifstream in(filename);
+    std::string line, word;
+    int linenum = 0;
+    if (!in.is_open()) {
+        std::cerr << "Error opening " << filename << ".\n";
+        exit(EXIT_FAILURE);
+    }
+    while (getline(in, line)) {
+        linenum++;
+        line = line.substr(0, line.find('#'));
+        line = trim(line);
+        if (line == "") continue;
+
+        size_t colon = line.find(':');
+        std::istringstream words(colon == std::string::npos ? "" : line.substr(colon + 1));
+        Microfield f = {line.substr(0, colon == std::string::npos ? 0 : colon), 0, 0, 0, false};
+        f.name = trim(f.name);
+        int bits[2] = {-1, -1};
+        for (int k=0; k < 2 && words >> word; k++) {
+            bits[k] = 0;
+            for (char c : word) bits[k] = hexval[c] > 15 || bits[k] > 63 ? 64 : (bits[k] << 4) | hexval[c];
+        }
+        if (f.name == "" || bits[1] < 0 || bits[0] > 63 || bits[1] > bits[0]) {
+            std::cerr << "Error: Invalid field: \"" << line << "\" [line " << linenum << "]\n";
+            exit(EXIT_FAILURE);
+        }
+        f.mask = (bits[0] == 63 ? ~0ull : (1ull << (bits[0] + 1)) - 1) & ~((1ull << bits[1]) - 1);
+        uint64_t* set = nullptr;
+        while (words >> word) {
+            if (word == "reads") set = &f.reads;
+            else if (word == "writes") set = &f.writes;
+            else if (word == "sequence") f.sequence = true;
+            else if (set) {
+                int id = resources.emplace(word, resources.size()).first->second;
+                if (id >= 64) {
+                    std::cerr << "Error: More than 64 resources [line " << linenum << "]\n";
+                    exit(EXIT_FAILURE);
+                }
+                *set |= 1ull << id;
+            }
+            else {
+                std::cerr << "Error: Expected reads, writes or sequence: \"" << word << "\" [line " << linenum << "]\n";
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (auto& other : fields)
+            if (other.mask & f.mask) {
+                std::cerr << "Error: Field " << f.name << " overlaps " << other.name << " [line " << linenum << "]\n";
+                exit(EXIT_FAILURE);
+            }
+        if (fields.size() == 64) {
+            std::cerr << "Error: More than 64 fields [line " << linenum << "]\n";
+            exit(EXIT_FAILURE);
+        }
+        fields.push_back(f);
+    }
+    return fields;
+}
+
+// merge non-conflicting microoperations of routine into fewer control words, exits on error
+void compactroutine(Microroutine& r, const std::vector<Microfield>& fields) {
+    struct Step {
+        uint64_t word = 0, used = 0, reads = 0, writes = 0;     // used - fields, one bit each
+        bool sequence = false, opaque = false;
+    };
+    uint64_t known = 0;
+    for (auto& f : fields) known |= f.mask;
+
+    std::vector<Step> steps;
+    size_t barrier = 0;                 // first control word later words may join
+    for (auto& text : r.words) {
+        if (text.length() > 16) {
+            std::cerr << "Error: Control word wider than 64 bits: \"" << text << "\" in routine \"" << r.name << "\" [line " << r.linenum << "]\n";
+            exit(EXIT_FAILURE);
+        }
+        Step op;
+        for (char c : text) op.word = (op.word << 4) | hexval[c];
+        op.opaque = op.word == 0 || (op.word & ~known) != 0;
+        for (size_t k=0; k < fields.size(); k++) {
+            if (!(op.word & fields[k].mask)) continue;
+            op.used |= 1ull << k;
+            op.reads |= fields[k].reads;
+            op.writes |= fields[k].writes;
+            op.sequence |= fields[k].sequence;
+        }
+
+        // earliest control word it can join, after those it depends on
+        size_t at = op.opaque ? steps.size() : barrier;
+        if (op.sequence && !steps.empty()) at = std::max(at, steps.size() - 1);
+        for (size_t g = at; g < steps.size(); g++) {
+            const Step& s = steps[g];
+            if ((s.writes & (op.reads | op.writes)) || (s.used & op.used)) at = g + 1;
+            else if (s.reads & op.writes) at = g;
+        }
+        while (at < steps.size() && (steps[at].used & op.used)) at++;
+        if (at == steps.size()) steps.emplace_back();
+        Step& s = steps[at];
+        s.word |= op.word;
+        s.used |= op.used;
+        s.reads |= op.reads;
+        s.writes |= op.writes;
+        s.sequence |= op.sequence;
+        if (op.sequence || op.opaque) barrier = at + 1;
+    }
+
+    r.words.clear();
+    for (auto& s : steps) {
+        char buf[17];
+        snprintf(buf, sizeof buf, "%llX", (unsigned long long)s.word);
+        r.words.push_back(buf);
+    }
+}
+
+// share tails and assign MPC addresses, returns number of microstore words used (exits if routines do not fit)
+int linkroutines(std::vector<Microroutine>& routines) {
+    std::vector<int> order;
+    std::vector<int> owner(MICROSTORE_SIZE, -1);       // routine occupying each word
+    int used = 0;
+
+    // longest routines first, so any routine that is a tail of another finds its host already placed
+    for (int i=0; i < (int)routines.size(); i++) order.push_back(i);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        if ((routines[a].fixed >= 0) != (routines[b].fixed >= 0)) return routines[a].fixed >= 0;
+        return routines[a].words.size() > routines[b].words.size();
+    });
+    for (int i : order) {
+        Microroutine& r = routines[i];
+        if (r.fixed >= 0) continue;
+        for (int h : order) {
+            const Microroutine& host = routines[h];
+            if (h == i || host.host >= 0 || host.words.size() < r.words.size()) continue;
+            if (&host == &r) break;
+            if (std::equal(r.words.begin(), r.words.end(), host.words.end() - r.words.size())) {
+                r.host = h;
+                break;
+            }
+        }
+    }
+
+    // place routines that own storage - pinned first, then first fit
+    for (int i : order) {
+        Microroutine& r = routines[i];
+        int len = r.words.size();
+        if (r.host >= 0) continue;
+        if (r.fixed >= 0) r.addr = r.fixed;
+        else {
+            for (int a = 0; a + len <= MICROSTORE_SIZE && r.addr < 0; a++) {
+                int n = 0;
+                while (n < len && owner[a + n] < 0) n++;
+                if (n == len) r.addr = a;
+                else a += n;
+            }
+        }
+        if (r.addr < 0 || r.addr + len > MICROSTORE_SIZE) {
+            std::cerr << "Error: Microstore full placing routine \"" << r.name << "\" [line " << r.linenum << "]\n";
+            exit(EXIT_FAILURE);
+        }
+        for (int a = r.addr; a < r.addr + len; a++) {
+            if (owner[a] >= 0) {
+                std::cerr << "Error: Routine \"" << r.name << "\" [line " << r.linenum << "] overlaps \"" << routines[owner[a]].name << "\" at MPC 0x" << std::hex << a << "\n";
+                exit(EXIT_FAILURE);
+            }
+            owner[a] = i;
+        }
+        used += len;
+    }
+    for (auto& r : routines)
+        if (r.host >= 0) r.addr = routines[r.host].addr + routines[r.host].words.size() - r.words.size();
+    return used;
+}
+
+// write microstore ROM as Logisim "v2.0 raw" image, unused words are 0
+bool writerom(const std::vector<Microroutine>& routines, const std::string& filename) {
+    std::vector<std::string> rom;
+    for (auto& r : routines) {
+        if (r.host >= 0) continue;
+        if (rom.size() < r.addr + r.words.size()) rom.resize(r.addr + r.words.size(), "0");
+        std::copy(r.words.begin(), r.words.end(), rom.begin() + r.addr);
+    }
+    std::string buf = "v2.0 raw\n";
+    for (size_t i=0; i < rom.size(); i++) buf += rom[i] + ((i + 1) % 8 ? " " : "\n");
+    buf += '\n';
+    std::ofstream out(filename);
+    if (!out.is_open()) return false;
+    out.write(buf.data(), buf.size());
+    return true;
+}
+
+// write mapping from instruction patterns to MPC addresses in mapping.conf format
+bool writemapping(const std::vector<Microroutine>& routines, const std::string& filename) {
+    std::string buf = "\
+# Specifies Mappings From ISA instr. patterns to Microstore Addresses (in Hex)\n\
+# ie. HLT : 3, maps HLT instruction to MPC 0x03\n\
+# 'X' indicates immediate value\n\
+# 'A' and 'B' indicate direct memory addresses\n\
+# 'XX', 'AA' and 'BB' indicate 2 byte operands (16-bit address mode)\n\
+# ',' delimits instruction arguments\n\
+# '#' - indicates comment\n\
+# Generated by the microcode linker - edit the microroutine source instead\n";
+    for (auto& r : routines) {
+        if (r.name[0] == '.') continue;
+        buf += r.name + " : " + std::string(hexstr[r.addr], 2) + '\n';
+    }
+    std::ofstream out(filename);
+    if (!out.is_open()) return false;
+    out.write(buf.data(), buf.size());
+    return true;
+}
+
+// link microroutine source into microstore ROM image and mapping file, compacting routines first if given fields
+int microlink(const std::string& srcname, const std::string& romname, const std::string& mapname, const std::string& fieldsname = "") {
+    std::vector<Microroutine> routines = readroutines(srcname);
+    if (fieldsname != "") {
+        std::vector<Microfield> fields = readfields(fieldsname);
+        int before = 0, after = 0;
+        std::cout << "Routine\t\tWords\tCompacted\n";
+        for (auto& r : routines) {
+            before += r.words.size();
+            std::cout << r.name << "\t\t" << r.words.size();
+            compactroutine(r, fields);
+            after += r.words.size();
+            std::cout << '\t' << r.words.size() << '\n';
+        }
+        std::cout << '\n' << routines.size() << " routines compacted from " << before << " to " << after << " control words\n\n";
+    }
+    int total = 0, shared = 0, used = linkroutines(routines);
+    for (auto& r : routines) {
+        total += r.words.size();
+        if (r.host >= 0) shared++;
+    }
+
+    std::cout << "Routine\t\tMPC\tWords\n";
+    for (auto& r : routines) {
+        std::cout << r.name << "\t\t0x" << std::hex << r.addr << '\t' << std::dec << r.words.size();
+        if (r.host >= 0) std::cout << "\t(tail of " << routines[r.host].name << ")";
+        std::cout << '\n';
+    }
+    std::cout << '\n' << std::dec << routines.size() << " routines linked into " << used << " microstore words ("
+              << (total - used) << " words saved by sharing " << shared << " routine tails)\n";
+
+    if (!writerom(routines, romname)) {
+        std::cerr << "Error creating " << romname << ".\n";
+        return -1;
+    }
+    if (!writemapping(routines, mapname)) {
+        std::cerr << "Error creating " << mapname << ".\n";
+        return -1;
+    }
+    std::cout << "Microstore written to " << romname << ", mapping written to " << mapname << ".\n";
+    return 0;
+}
+
+#endif
@@ -2,11 +2,6 @@
 # a constant of 0x05. The program halts when an arithemetic overflow is detected 
 # (when the V flag goes high). The value of the sum is constantly displays on the output.
 
-# Note: a bug exists where labels must include at minimum one valid hexadecimal
-#   character (0-9, A-F) to jump to. This is an unintended byproduct of the 
-#   instruction identification and validation process. Hence why 'loop1' is 
-#   used instead of 'loop'.
-
 
 # 0xC0 is output buffer
 # 0xC4 is input buffer
@@ -16,7 +11,7 @@ init:
     mov $50, 0x12   # sum is stored at 0x50. init to 0x12
     mov $C0, $50    # update display
 
-loop1:
+loop:
     cmp 1           # clear PSW flags to avoid unintended add w/ carry
     add $50, 05     # increment sum by 0x05
     mov $C0, $50    # update display
@@ -26,7 +21,7 @@ loop1:
     cmp $51, 4      # zero set if V flag set
     brz exit        # exit if overflow occurs
 
-    jmp loop1       # iterate
+    jmp loop        # iterate
 
 exit:
     hlt             # terminate program
\ No newline at end of file
@@ -0,0 +1,146 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+/*
+    Line Scanner
+    - Classifies source text 64 characters at a time into one bitmask per character class:
+        line ends, comment starts ('#'), ':', '$', ',', '@' and whitespace (' ', '\t', '\r').
+        Blocks are classified 32 characters at a time with AVX2 when the CPU supports it,
+        otherwise 16 at a time with SSE2, with a scalar fallback on other architectures.
+    - The lexer splits files into lines at the line end bits, and parse() finds the comment
+        start, label colon and end of the mnemonic of each line from its masks instead of
+        testing characters one at a time
+    - foldupper converts ASCII letters to uppercase in bulk, so mnemonics and operands are
+        case-folded once per line
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SCAN_SIMD
+#endif
+
+enum ScanClass { SCAN_EOL, SCAN_HASH, SCAN_COLON, SCAN_DOLLAR, SCAN_COMMA, SCAN_AT, SCAN_SPACE, SCAN_CLASSES };
+enum ScanImpl { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+
+// bit i of mask[c] is set if character i of the block is of class c
+struct ScanBlock {
+    uint64_t mask[SCAN_CLASSES];
+};
+
+inline void scanblock_scalar(const char* s, ScanBlock& b) {
+    memset(b.mask, 0, sizeof b.mask);
+    for (int i=0; i < 64; i++) {
+        uint64_t bit = 1ull << i;
+        switch (s[i]) {
+            case '\n': b.mask[SCAN_EOL] |= bit; break;
+            case '#':  b.mask[SCAN_HASH] |= bit; break;
+            case ':':  b.mask[SCAN_COLON] |= bit; break;
+            case '$':  b.mask[SCAN_DOLLAR] |= bit; break;
+            case ',':  b.mask[SCAN_COMMA] |= bit; break;
+            case '@':  b.mask[SCAN_AT] |= bit; break;
+            case ' ': case '\t': case '\r': b.mask[SCAN_SPACE] |= bit; break;
+        }
+    }
+}
+
+#ifdef SCAN_SIMD
+inline void scanblock_sse2(const char* s, ScanBlock& b) {
+    static const char chars[SCAN_CLASSES - 1] = {'\n', '#', ':', '$', ',', '@'};
+    memset(b.mask, 0, sizeof b.mask);
+    for (int k=0; k < 4; k++) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + 16*k));
+        for (int c=0; c < SCAN_CLASSES - 1; c++)
+            b.mask[c] |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(chars[c]))) << (16*k);
+        __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                                  _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+        b.mask[SCAN_SPACE] |= (uint64_t)(unsigned)_mm_movemask_epi8(ws) << (16*k);
+    }
+}
+
+__attribute__((target("avx2")))
+inline void scanblock_avx2(const char* s, ScanBlock& b) {
+    static const char chars[SCAN_CLASSES - 1] = {'\n', '#', ':', '$', ',', '@'};
+    memset(b.mask, 0, sizeof b.mask);
+    for (int k=0; k < 2; k++) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(s + 32*k));
+        for (int c=0; c < SCAN_CLASSES - 1; c++)
+            b.mask[c] |= (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(chars[c]))) << (32*k);
+        __m256i ws = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+                                     _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+        b.mask[SCAN_SPACE] |= (uint64_t)(unsigned)_mm256_movemask_epi8(ws) << (32*k);
+    }
+}
+#endif
+
+// fastest implementation the CPU supports
+inline ScanImpl scanbest() {
+#ifdef SCAN_SIMD
+    static const ScanImpl best = __builtin_cpu_supports("avx2") ? SCAN_AVX2 : SCAN_SSE2;
+    return best;
+#else
+    return SCAN_SCALAR;
+#endif
+}
+
+// classify n characters into blocks (the last block is padded with characters of no class)
+inline void scan(const char* s, size_t n, std::vector<ScanBlock>& blocks, ScanImpl impl = scanbest()) {
+    blocks.resize((n + 63) / 64);
+    char tail[64];
+    for (size_t i=0; i < blocks.size(); i++) {
+        const char* p = s + 64*i;
+        if (64*i + 64 > n) {
+            memset(tail, 0, sizeof tail);
+            memcpy(tail, p, n - 64*i);
+            p = tail;
+        }
+#ifdef SCAN_SIMD
+        if (impl == SCAN_AVX2) scanblock_avx2(p, blocks[i]);
+        else if (impl == SCAN_SSE2) scanblock_sse2(p, blocks[i]);
+        else
+#endif
+        scanblock_scalar(p, blocks[i]);
+    }
+}
+
+// position of first character of class in [from, to), or to if none
+inline size_t scanfirst(const std::vector<ScanBlock>& blocks, ScanClass c, size_t from, size_t to) {
+    for (size_t i = from / 64; i < blocks.size() && 64*i < to; i++) {
+        uint64_t m = blocks[i].mask[c];
+        if (i == from / 64) m &= ~0ull << (from % 64);
+        if (m) {
+            size_t at = 64*i + __builtin_ctzll(m);
+            return at < to ? at : to;
+        }
+    }
+    return to;
+}
+
+// position of last character of class in [from, to), or to if none
+inline size_t scanlast(const std::vector<ScanBlock>& blocks, ScanClass c, size_t from, size_t to) {
+    for (size_t i = (to + 63) / 64; i-- > from / 64; ) {
+        uint64_t m = blocks[i].mask[c];
+        if (64*i + 64 > to) m &= to % 64 ? ~0ull >> (64 - to % 64) : ~0ull;
+        if (i == from / 64) m &= ~0ull << (from % 64);
+        if (m) return 64*i + 63 - __builtin_clzll(m);
+    }
+    return to;
+}
+
+// copy n characters to out with ASCII letters in uppercase
+inline void foldupper(const char* s, size_t n, char* out) {
+    size_t i = 0;
+#ifdef SCAN_SIMD
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i lower = _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(v, _mm_set1_epi8('a')), _mm_set1_epi8(25)), _mm_setzero_si128());   // 'a' <= c <= 'z'
+        _mm_storeu_si128((__m128i*)(out + i), _mm_xor_si128(v, _mm_and_si128(lower, _mm_set1_epi8(0x20))));
+    }
+#endif
+    for (; i < n; i++) out[i] = s[i] >= 'a' && s[i] <= 'z' ? s[i] - 32 : s[i];
+}
+
+#endif